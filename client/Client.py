@@ -1,6 +1,14 @@
 from socket import *
 import sys
+import os
 import os.path
+import stat
+import struct
+import hashlib
+import time
+import ssl
+import zlib
+from itertools import accumulate
 
 class Client:
     """implementation of Client class"""
@@ -19,6 +27,17 @@ class Client:
     #           - filename (if command == -g)
     #       - False if args not valid, prints error message
     def validate_args(self, args):
+        # optional -t <CA_FILE> at the end turns on TLS, server's certificate
+        # must be signed by a certificate in CA_FILE
+        self.tls_context = None
+        if len(args) > 2 and args[-2] == "-t":
+            try:
+                self.tls_context = ssl.create_default_context(cafile=args[-1])
+            except Exception:
+                print(f"ERROR: unable to load CA file {args[-1]}", file=sys.stderr)
+                return False
+            args = args[:-2]
+
         # must have at least 5 args
         if len(args) < 5:
             return False
@@ -29,17 +48,25 @@ class Client:
         else:
             self.host_name = args[1]
 
-        # make sure server port is a number
-        try:
-            self.command_port = int(args[2])
-        except:
-            print("ERROR: invalid server port number", file=sys.stderr)
-            return False
+        # host "unix" connects to the server's unix socket, path in place of port
+        self.unix_path = None
+        if self.host_name == "unix":
+            self.unix_path = args[2]
+            self.command_port = args[2]
+        else:
+            # make sure server port is a number
+            try:
+                self.command_port = int(args[2])
+            except:
+                print("ERROR: invalid server port number", file=sys.stderr)
+                return False
 
         # check for valid command
         self.command = args[3]
+        if len(args) < 5:
+            return False
         
-        if self.command == "-l":
+        if self.command in ("-l", "-L", "-R"):
 
             # list command, must be followed by data port number
             try:
@@ -52,8 +79,9 @@ class Client:
             if len(args) > 5:
                 return False
 
-        elif self.command == "-g":
-            # list command, must be followed by filename and data port number
+        elif self.command in ("-g", "-d", "-p", "-a"):
+            # get, delta get, put or directory get command, must be followed by
+            # filename and data port number
             
             # assign filename arg to instance variable
             self.filename = args[4]
@@ -68,6 +96,27 @@ class Client:
             # check if too many arguments
             if len(args) > 6:
                 return False
+
+            # file to put must exist locally
+            if self.command == "-p" and not os.path.isfile(self.filename):
+                print(f"ERROR: \"{self.filename}\" is not a file", file=sys.stderr)
+                return False
+        elif self.command == "-f":
+            # get file as a descriptor passed on the command socket, only
+            # on unix socket connections. no data connection is used
+            self.filename = args[4]
+            if self.unix_path is None:
+                print("ERROR: -f needs a unix socket connection", file=sys.stderr)
+                return False
+            return len(args) == 5
+        elif self.command == "-c":
+            # control command, followed by setting and optional value.
+            # no data connection is used
+            self.setting = args[4]
+            self.value = args[5] if len(args) > 5 else ""
+            if len(args) > 6:
+                return False
+            return True
         else:
             print("ERROR: invalid command", file=sys.stderr)
             return False
@@ -89,7 +138,34 @@ class Client:
     # output:
     #       - stores connected socket in instance variable
     def connect_to_server(self):
+        if self.unix_path is not None:
+            # unix socket connections aren't encrypted
+            self.commandfd = socket(AF_UNIX, SOCK_STREAM)
+            self.commandfd.connect(self.unix_path)
+            return
         self.commandfd = create_connection((self.host_name, self.command_port))
+        if self.tls_context is not None:
+            self.commandfd = self.tls_context.wrap_socket(self.commandfd,
+                                                          server_hostname=self.host_name)
+
+
+    # function to accept the server's connection to the data socket. with
+    # TLS, the server is still the TLS server, and the session of the
+    # command connection is resumed to skip a full handshake.
+    # input:
+    #       - none, uses instance variable, datafd
+    # output:
+    #       - connected data socket
+    def accept_data_connection(self):
+        datafd, addr = self.datafd.accept()
+        if self.unix_path is not None:
+            # server is connected, path isn't needed anymore
+            os.unlink(self.data_path)
+            return datafd
+        if self.tls_context is not None:
+            datafd = self.tls_context.wrap_socket(datafd, server_hostname=self.host_name,
+                                                  session=self.commandfd.session)
+        return datafd
 
 
     # function to send command to to server. builds command string from args
@@ -101,10 +177,16 @@ class Client:
     #       - no return value, command message is sent to server
     def send_command(self):
         # build string depending on command
-        if self.command == "-l":
+        if self.command in ("-l", "-L", "-R"):
             command_string = f"{self.command} {str(self.data_port)}"
-        elif self.command == "-g":
-            command_string = f"{self.command} {self.filename} {str(self.data_port)}"
+        elif self.command in ("-g", "-d", "-p"):
+            command_string = f"{self.command} {os.path.basename(self.filename)} {str(self.data_port)}"
+        elif self.command == "-a":
+            command_string = f"{self.command} {self.archive_root()} {str(self.data_port)}"
+        elif self.command == "-f":
+            command_string = f"{self.command} {os.path.basename(self.filename)}"
+        elif self.command == "-c":
+            command_string = f"{self.command} {self.setting} {self.value}".strip()
         
         # build complete message to send, including length of command string
         total_message = f"{len(command_string)}${command_string}"
@@ -120,6 +202,15 @@ class Client:
     #       - no return value. actively listening socket stored in instance var
     #          called datafd.
     def create_data_socket(self):
+        if self.unix_path is not None:
+            # server connects back to <server socket path>.<data port>
+            self.data_path = f"{self.unix_path}.{self.data_port}"
+            if os.path.exists(self.data_path):
+                os.unlink(self.data_path)
+            self.datafd = socket(AF_UNIX, SOCK_STREAM)
+            self.datafd.bind(self.data_path)
+            self.datafd.listen(1)
+            return
         self.datafd = socket(AF_INET, SOCK_STREAM)
         self.datafd.bind(('', self.data_port))
         self.datafd.listen(1)
@@ -175,7 +266,7 @@ class Client:
     #         message 
     def handle_directory_info(self):
         # accept data transfer connection
-        datafd, addr = self.datafd.accept()
+        datafd = self.accept_data_connection()
         print(f"Receiving directory structure from {self.host_name}:{self.data_port}")
         
         # receive data from server
@@ -201,7 +292,7 @@ class Client:
     # code to check if file exists based on:
     # https://stackoverflow.com/questions/82831/how-do-i-check-whether-a-file-exists-without-exceptions
     def handle_file_transfer(self):
-        datafd, addr = self.datafd.accept()
+        datafd = self.accept_data_connection()
         print(f"Receiving \"{self.filename}\" from {self.host_name}:{self.data_port}")
         contents = self.receive_message(datafd)
         if contents[:5] == "ERROR":
@@ -230,3 +321,279 @@ class Client:
                 return True
             elif res.strip().upper() == "N":
                 return False
+
+
+    # function to receive exactly n bytes from a socket, with no framing.
+    # input:
+    #       - active socket to read from
+    #       - number of bytes to read
+    # output:
+    #       - bytes received, raises ConnectionError if connection closes first
+    def receive_exact(self, fd, n):
+        chunks = []
+        while n > 0:
+            received = fd.recv(min(n, 1 << 20))
+            if received == b'':
+                raise ConnectionError("connection with server has been broken")
+            chunks.append(received)
+            n -= len(received)
+        return b''.join(chunks)
+
+
+    # function to receive a binary message from server, in the same
+    # <length>$<data> format as receive_message, but without decoding.
+    # input:
+    #       - active socket to read from
+    # output:
+    #       - bytes of message, raises ConnectionError if connection closes
+    def receive_bytes(self, fd):
+        length = b''
+        while True:
+            c = self.receive_exact(fd, 1)
+            if c == b'$':
+                break
+            length += c
+        return self.receive_exact(fd, int(length))
+
+
+    # function to receive a metadata listing from server. each page holds
+    # a count of 40 byte entry records followed by a table of names. prints
+    # each entry as it arrives, until an empty page marks the end.
+    # input:
+    #       - none, uses instance variable, datafd
+    # output:
+    #       - no return value, prints mode, size, mtime, inode and name of
+    #         each entry, or error message
+    def handle_directory_stat(self):
+        datafd = self.accept_data_connection()
+        print(f"Receiving directory listing from {self.host_name}:{self.data_port}")
+
+        record_len = struct.calcsize("!QqIIQIHH")
+        try:
+            while True:
+                page = self.receive_bytes(datafd)
+                count, names_len = struct.unpack("!II", page[:8])
+                if count == 0:
+                    break
+                names = page[8 + count * record_len:]
+                for i in range(count):
+                    start = 8 + i * record_len
+                    size, mtime, mtime_nsec, mode, inode, name_offset, name_len, _ = \
+                        struct.unpack("!QqIIQIHH", page[start:start + record_len])
+                    name = names[name_offset:name_offset + name_len].decode(errors="replace")
+                    when = time.strftime("%Y-%m-%d %H:%M", time.localtime(mtime))
+                    print(f"{stat.filemode(mode)} {size:>12} {when} {inode:>10} {name}")
+        except ConnectionError as e:
+            print(f"ERROR: {e}", file=sys.stderr)
+
+        datafd.close()
+
+
+    # function to build the block signature of the existing copy of the
+    # requested file, for a delta get. each full block gets an rsync style
+    # weak checksum and an md5. block size grows with the square root of
+    # the file size, like rsync.
+    # input:
+    #       - none, uses instance variable, filename
+    # output:
+    #       - bytes, <block_size><block_count> then <weak><md5> per block,
+    #         all integers 4 byte network order. no blocks if file doesn't exist
+    def build_signature(self):
+        size = os.path.getsize(self.filename) if os.path.isfile(self.filename) else 0
+        block_size = max(700, min(1 << 17, int(size ** 0.5) // 8 * 8))
+        entries = []
+        if size > 0:
+            with open(self.filename, "rb") as old_file:
+                while True:
+                    block = old_file.read(block_size)
+                    if len(block) < block_size:
+                        break
+                    # a = sum of bytes, b = sum of running values of a
+                    a = sum(block) & 0xffff
+                    b = sum(accumulate(block)) & 0xffff
+                    entries.append(struct.pack("!I", a | (b << 16)))
+                    entries.append(hashlib.md5(block).digest())
+        header = struct.pack("!II", block_size, len(entries) // 2)
+        return header + b''.join(entries)
+
+
+    # function to receive a delta from server and rebuild the file in place.
+    # literal records are written at the current offset, block records copy
+    # a block of the old copy to the current offset. the server only
+    # references blocks at or after the current offset, so they haven't been
+    # overwritten yet, and blocks already in the right place are skipped.
+    # input:
+    #       - none, uses instance variables
+    # output:
+    #       - no return value, file is updated to match server's copy
+    def handle_delta_transfer(self):
+        signature = self.build_signature()
+        block_size = struct.unpack("!I", signature[:4])[0]
+        self.commandfd.sendall(f"{len(signature)}$".encode() + signature)
+
+        datafd = self.accept_data_connection()
+        print(f"Receiving delta of \"{self.filename}\" from {self.host_name}:{self.data_port}")
+
+        try:
+            high, low = struct.unpack("!II", self.receive_exact(datafd, 8))
+            new_size = (high << 32) | low
+
+            mode = "r+b" if os.path.isfile(self.filename) else "w+b"
+            literal_bytes = 0
+            with open(self.filename, mode) as out_file:
+                offset = 0
+                while True:
+                    op = self.receive_exact(datafd, 1)
+                    if op == b'E':
+                        break
+                    value = struct.unpack("!I", self.receive_exact(datafd, 4))[0]
+                    if op == b'L':
+                        out_file.seek(offset)
+                        out_file.write(self.receive_exact(datafd, value))
+                        offset += value
+                        literal_bytes += value
+                    elif op == b'B':
+                        source = value * block_size
+                        if source != offset:
+                            out_file.seek(source)
+                            block = out_file.read(block_size)
+                            out_file.seek(offset)
+                            out_file.write(block)
+                        offset += block_size
+                    else:
+                        raise ConnectionError("invalid delta received from server")
+                out_file.truncate(new_size)
+            print(f"Delta transfer complete, {literal_bytes} of {new_size} bytes sent")
+        except ConnectionError as e:
+            print(f"ERROR: {e}", file=sys.stderr)
+
+        datafd.close()
+
+
+    # function to upload a file to the server. sends the size of the file on
+    # the command socket, accepts the data connection and sends the file
+    # contents on it, then waits for the server's final status.
+    # input:
+    #       - none, uses instance variables
+    # output:
+    #       - no return value, prints whether file was stored
+    def handle_file_upload(self):
+        size = os.path.getsize(self.filename)
+        size_string = str(size)
+        self.commandfd.sendall(f"{len(size_string)}${size_string}".encode())
+
+        datafd = self.accept_data_connection()
+        print(f"Sending \"{self.filename}\" to {self.host_name}:{self.data_port}")
+        with open(self.filename, "rb") as upload_file:
+            datafd.sendfile(upload_file, 0, size)
+        datafd.close()
+
+        status = self.receive_message(self.commandfd)
+        if status == "OK":
+            print("File upload complete")
+        else:
+            print(status, file=sys.stderr)
+
+
+    # function to get a file as a descriptor passed by the server on the
+    # command socket. reply is "OK <offset> <length>" with the descriptor
+    # attached, the file is copied from it in the kernel. if matching
+    # filename already exists, asks user if they want to replace it.
+    # input:
+    #       - none, uses instance variables
+    # output:
+    #       - no return value, prints whether file was received, or error
+    def handle_fd_transfer(self):
+        received, fds, flags, addr = recv_fds(self.commandfd, 1024, 1)
+        try:
+            # rest of reply, if it didn't arrive with the descriptor
+            delim = received.index(b"$")
+            message_len = int(received[:delim])
+            message = received[delim + 1:]
+            if len(message) < message_len:
+                message += self.receive_exact(self.commandfd, message_len - len(message))
+            status = message.decode()
+
+            if not status.startswith("OK") or len(fds) != 1:
+                print(f"{self.host_name}:{self.command_port} says \'{status}\'", file=sys.stderr)
+                return
+
+            offset, length = (int(n) for n in status.split()[1:3])
+            if os.path.exists(self.filename) and not self.replace_file():
+                return
+            with open(self.filename, "wb") as new_file:
+                copied = 0
+                while copied < length:
+                    n = os.copy_file_range(fds[0], new_file.fileno(), length - copied,
+                                           offset + copied)
+                    if n == 0:
+                        break
+                    copied += n
+            print(f"File transfer complete, {copied} bytes copied from passed descriptor")
+        finally:
+            for fd in fds:
+                os.close(fd)
+
+
+    # name of directory requested with -a, which is also the local
+    # directory the archive is written to
+    def archive_root(self):
+        return os.path.basename(self.filename.rstrip("/"))
+
+
+    # function to receive a directory as an archive from server. each frame
+    # holds a 32 byte header, the entry's path relative to the directory,
+    # and data, either a complete zlib stream or stored as is. files are
+    # written at the offset of each frame, so large files arrive in pieces.
+    # modes and modification times are set once the end frame arrives. if
+    # directory already exists, asks user if they want to replace its files.
+    # input:
+    #       - none, uses instance variables, datafd and filename
+    # output:
+    #       - no return value, prints whether archive was received, or error
+    def handle_archive_transfer(self):
+        datafd = self.accept_data_connection()
+        root = self.archive_root()
+        print(f"Receiving archive of \"{root}\" from {self.host_name}:{self.data_port}")
+        if os.path.exists(root) and not self.replace_file():
+            datafd.close()
+            return
+
+        header_len = struct.calcsize("!BBHIQQq")
+        received = {}
+        try:
+            os.makedirs(root, exist_ok=True)
+            while True:
+                frame = self.receive_bytes(datafd)
+                kind, encoding, name_len, mode, offset, size, mtime = \
+                    struct.unpack("!BBHIQQq", frame[:header_len])
+                if kind == 3:
+                    break
+
+                # paths must stay inside the directory
+                name = frame[header_len:header_len + name_len].decode()
+                parts = name.split("/")
+                if name.startswith("/") or ".." in parts or "" in parts:
+                    raise ConnectionError(f"invalid path \"{name}\" in archive")
+                path = os.path.join(root, name)
+                if kind == 1:
+                    os.makedirs(path, exist_ok=True)
+                    continue
+
+                data = frame[header_len + name_len:]
+                if encoding == 1:
+                    data = zlib.decompress(data)
+                with open(path, "r+b" if path in received else "wb") as new_file:
+                    new_file.seek(offset)
+                    new_file.write(data)
+                received[path] = (mode, mtime)
+        except (ConnectionError, zlib.error, OSError, UnicodeDecodeError, struct.error) as e:
+            print(f"ERROR: {e}", file=sys.stderr)
+            datafd.close()
+            return
+
+        for path, (mode, mtime) in received.items():
+            os.chmod(path, stat.S_IMODE(mode))
+            os.utime(path, (mtime, mtime))
+        print(f"Archive transfer complete, {offset} files ({size} bytes)")
+        datafd.close()
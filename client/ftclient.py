@@ -2,11 +2,27 @@
 # Author: Sam Judkis
 # Description:
 #   main file for file transfer client, using my original Client class.
-#   accepts command line argument in two ways:
+#   accepts command line argument in several ways:
 #       1. list directory:
 #           ftclient.py <SERVER_HOST> <SERVER_PORT> -l <DATA_PORT>
 #       2. file transfer:
 #           ftclient.py <SERVEr_HOST> <SERVER_PORT> -g <FILENAME> <DATA_PORT>
+#       3. delta transfer, only changed parts of an existing copy are sent:
+#           ftclient.py <SERVER_HOST> <SERVER_PORT> -d <FILENAME> <DATA_PORT>
+#       4. file upload:
+#           ftclient.py <SERVER_HOST> <SERVER_PORT> -p <FILENAME> <DATA_PORT>
+#       5. list directory with size, mtime, mode and inode, -R includes subdirectories:
+#           ftclient.py <SERVER_HOST> <SERVER_PORT> -L|-R <DATA_PORT>
+#       6. change server settings from the server's host (rate, hostrate, loglevel,
+#          tracesample, status, tracedump):
+#           ftclient.py <SERVER_HOST> <SERVER_PORT> -c <SETTING> [VALUE]
+#       7. get file as a descriptor passed by the server, unix socket connections only:
+#           ftclient.py unix <SOCKET_PATH> -f <FILENAME>
+#       8. get a directory and everything under it as one compressed archive:
+#           ftclient.py <SERVER_HOST> <SERVER_PORT> -a <DIRNAME> <DATA_PORT>
+#   any command can be followed by -t <CA_FILE> to use TLS with a server started with -t.
+#   with host "unix", the server's unix socket path is given in place of the port and
+#   the data connection is a unix socket too
 #   
 #   validates command arguments, connects to server, and sends command.
 #   gets a command status message back from server, if message is "OK", opens
@@ -28,9 +44,18 @@ def main():
     client = Client()
     if not client.validate_args(sys.argv):
         print("USAGE: ftclient.py <SERVER_HOST> <SERVER_PORT#> " + \
-                "<COMMAND> [FILENAME] <DATA_PORT#>", file=sys.stderr)
+                "<COMMAND> [FILENAME] <DATA_PORT#> [-t <CA_FILE>]", file=sys.stderr)
         return 1
 
+    # create data transfer socket before sending the command, so it is
+    # already listening when the server connects back
+    if client.command not in ("-c", "-f"):
+        try:
+            client.create_data_socket()
+        except:
+            print(f"ERROR: unable to create data socket on port {client.data_port}", file=sys.stderr)
+            return 5
+
     # attempt to connect to server on command port
     try:
         client.connect_to_server()
@@ -46,6 +71,17 @@ def main():
         client.commandfd.close()
         return 3
 
+    # descriptor comes with the status message
+    if client.command == "-f":
+        try:
+            client.handle_fd_transfer()
+        except Exception:
+            print(f"ERROR: unable to receive from server on port {client.command_port}", file=sys.stderr)
+            client.commandfd.close()
+            return 4
+        client.commandfd.close()
+        return 0
+
     # receive command status message from server
     try:
         command_status = client.receive_message(client.commandfd)
@@ -54,23 +90,33 @@ def main():
         client.commandfd.close()
         return 4
     
-    # if OK received, command is valid, prepare to receive data through data
-    # port socket
-    if command_status == "OK":
-        # create data transfer socket
-        try:
-            client.create_data_socket()
-        except:
-            print(f"ERROR: unable to create data socket on port {client.data_port}", file=sys.stderr)
-            client.commandfd.close()
-            return 5
+    # control commands are answered on the command socket only
+    if client.command == "-c":
+        out = sys.stderr if command_status.startswith("ERROR") else sys.stdout
+        print(command_status, file=out)
+        client.commandfd.close()
+        return 0 if out is sys.stdout else 6
 
+    # if OK received, command is valid, receive data through data port socket
+    if command_status == "OK":
         if client.command == "-l":
             # call function to receive directory data
             client.handle_directory_info()
+        elif client.command in ("-L", "-R"):
+            # call function to receive metadata listing
+            client.handle_directory_stat()
         elif client.command == "-g":
             # call function to receive file data
             client.handle_file_transfer()
+        elif client.command == "-d":
+            # call function to send signature and receive delta
+            client.handle_delta_transfer()
+        elif client.command == "-p":
+            # call function to send file data
+            client.handle_file_upload()
+        elif client.command == "-a":
+            # call function to receive directory archive
+            client.handle_archive_transfer()
     
     else:
         # otherwise, there is an error, print received message and exit
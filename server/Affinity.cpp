@@ -0,0 +1,223 @@
+#include "Affinity.hpp"
+#include "Logger.hpp"
+#include <cstdlib>
+#include <cerrno>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <numa.h>
+
+using std::vector;
+
+vector<int> Affinity::cpus;
+cpu_set_t Affinity::worker_mask;
+bool Affinity::steering = false;
+std::atomic<unsigned long long> Affinity::steered(0);
+
+// CPUs the calling thread ran on before it was steered
+static thread_local cpu_set_t home_mask;
+
+// true if libnuma can place memory on nodes, checked once
+static bool numa_usable()
+{
+    static const bool usable = (numa_available() >= 0);
+    return usable;
+}
+
+// I/O buffers of one thread, one for each node it has run on. allocated
+// on first use and freed when the thread exits
+struct NodeBuffers
+{
+    char *buffers[AFFINITY_MAX_NODES];
+    bool from_numa[AFFINITY_MAX_NODES];     // freed with numa_free, not free
+
+    ~NodeBuffers()
+    {
+        for (int node = 0; node < AFFINITY_MAX_NODES; node++)
+        {
+            if (buffers[node] != NULL && from_numa[node])
+                numa_free(buffers[node], AFFINITY_BUFFER_SIZE);
+            else
+                free(buffers[node]);
+        }
+    }
+};
+static thread_local NodeBuffers node_buffers;
+
+// records the CPUs the process may run on. must be called before any
+// other Affinity function, and before threads are started
+void Affinity::init()
+{
+    CPU_ZERO(&worker_mask);
+    sched_getaffinity(0, sizeof(worker_mask), &worker_mask);
+}
+
+/**************************************************
+ * parses a list of CPUs for client handling threads, like "0-3,8,10-11".
+ * threads are pinned to them in the order given, see pin_thread
+ * Inputs:
+ *      - const char *, CPU list
+ * Outputs:
+ *      - bool, false if list is invalid or has a CPU the process can't
+ *        use, error is logged
+**************************************************/
+bool Affinity::set_cpus(const char *list)
+{
+    vector<int> parsed;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+
+    const char *pos = list;
+    while (true)
+    {
+        char *end;
+        errno = 0;
+        long first = strtol(pos, &end, 10);
+        long last = first;
+        bool ok = (end != pos && errno == 0);
+        if (ok && *end == '-')
+        {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            ok = (end != pos && errno == 0);
+        }
+        ok = ok && first >= 0 && first <= last && last < CPU_SETSIZE &&
+             (*end == ',' || *end == '\0');
+        for (long cpu = first; ok && cpu <= last; cpu++)
+        {
+            if (!CPU_ISSET(cpu, &worker_mask))
+            {
+                log_error("CPU %d is not available to the server", (int)cpu);
+                return false;
+            }
+            if (!CPU_ISSET(cpu, &mask))
+                parsed.push_back(cpu);
+            CPU_SET(cpu, &mask);
+        }
+        if (!ok)
+        {
+            log_error("invalid CPU list \"%s\"", list);
+            return false;
+        }
+        if (*end == '\0')
+            break;
+        pos = end + 1;
+    }
+
+    cpus = parsed;
+    worker_mask = mask;
+    log_info("Pinning client threads to %d CPUs", (int)cpus.size());
+    return true;
+}
+
+// moves accepted connections to the CPU that received them, see steer
+void Affinity::set_steering(bool enabled)
+{
+    steering = enabled;
+}
+
+// sets the calling thread's CPUs, logs if the kernel refuses
+void Affinity::set_mask(const cpu_set_t &mask)
+{
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+    if (error != 0)
+        log_warn("unable to set thread affinity, error %d", error);
+}
+
+// pins the calling thread to one of the CPUs given to set_cpus, chosen by
+// the thread's index in its team. does nothing if no CPUs were given
+void Affinity::pin_thread(int index)
+{
+    if (cpus.empty())
+        return;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpus[index % cpus.size()], &mask);
+    set_mask(mask);
+}
+
+// lets the calling thread run on any worker CPU. threads of a team
+// created within a request start with the affinity of the thread that
+// created them, which is a single CPU when pinned or steered
+void Affinity::spread_thread()
+{
+    if (!cpus.empty() || steering)
+        set_mask(worker_mask);
+}
+
+/**************************************************
+ * moves the calling thread to the CPU that received the latest packets of
+ * a connection (SO_INCOMING_CPU), so the thread runs where that NIC
+ * queue's interrupts put the socket's data. only CPUs workers may use are
+ * chosen. undo with unsteer when the connection is done
+ * Inputs:
+ *      - int, fd of connected socket
+ * Outputs:
+ *      - bool, true if thread was moved
+**************************************************/
+bool Affinity::steer(int fd)
+{
+    if (!steering)
+        return false;
+
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0 ||
+        cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &worker_mask))
+        return false;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(home_mask), &home_mask) != 0)
+        return false;
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    set_mask(mask);
+    steered.fetch_add(1, std::memory_order_relaxed);
+    log_debug("Handling connection on CPU %d", cpu);
+    return true;
+}
+
+// returns the calling thread to the CPUs it used before steer
+void Affinity::unsteer()
+{
+    set_mask(home_mask);
+}
+
+/**************************************************
+ * I/O buffer of AFFINITY_BUFFER_SIZE bytes, in memory of the NUMA node
+ * the calling thread is running on. each thread has its own, so it must
+ * not be held across calls that may use it again
+ * Inputs:
+ *      - none
+ * Outputs:
+ *      - char *, buffer, or NULL if it can't be allocated
+**************************************************/
+char *Affinity::buffer()
+{
+    int node = 0;
+    int cpu = sched_getcpu();
+    if (numa_usable() && cpu >= 0)
+        node = numa_node_of_cpu(cpu);
+    if (node < 0 || node >= AFFINITY_MAX_NODES)
+        node = 0;
+
+    char *&buffer = node_buffers.buffers[node];
+    if (buffer == NULL)
+    {
+        node_buffers.from_numa[node] = numa_usable();
+        if (numa_usable())
+            buffer = (char *)numa_alloc_onnode(AFFINITY_BUFFER_SIZE, node);
+        if (buffer == NULL)
+        {
+            node_buffers.from_numa[node] = false;
+            buffer = (char *)malloc(AFFINITY_BUFFER_SIZE);
+        }
+    }
+    return buffer;
+}
+
+// number of pinned CPUs and connections steered so far, for status
+string Affinity::status()
+{
+    return "pinned=" + std::to_string(cpus.size()) +
+           " steered=" + std::to_string(steered.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,63 @@
+// Header file for Affinity class
+#ifndef AFFINITY_HPP
+#define AFFINITY_HPP
+
+#include <cstddef>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <sched.h>
+
+using std::string;
+
+// size of each thread's I/O buffer
+#define AFFINITY_BUFFER_SIZE (64 * 1024)
+
+// NUMA nodes a thread can keep a buffer on
+#define AFFINITY_MAX_NODES 64
+
+// places client handling threads on chosen CPUs, and optionally moves the
+// thread handling a connection to the CPU that received its packets (the
+// CPU handling that NIC queue). each thread's I/O buffer is allocated on
+// the NUMA node it runs on, so socket buffers, page cache pages and the
+// buffers copied between them stay on one node
+class Affinity
+{
+    private:
+        static std::vector<int> cpus;       // CPUs workers are pinned to, empty if not pinned
+        static cpu_set_t worker_mask;       // all CPUs workers may use
+        static bool steering;
+        static std::atomic<unsigned long long> steered;
+
+        static void set_mask(const cpu_set_t &mask);
+    public:
+        static void init();
+        static bool set_cpus(const char *list);
+        static void set_steering(bool enabled);
+        static void pin_thread(int index);
+        static void spread_thread();
+        static bool steer(int fd);
+        static void unsteer();
+        static char *buffer();
+        static string status();
+};
+
+// runs the calling thread on the CPU that received a connection's packets,
+// from construction to destruction, if steering is enabled
+class ScopedSteer
+{
+    private:
+        bool moved;
+    public:
+        ScopedSteer(int fd)
+        {
+            moved = Affinity::steer(fd);
+        }
+        ~ScopedSteer()
+        {
+            if (moved)
+                Affinity::unsteer();
+        }
+};
+
+#endif
@@ -0,0 +1,474 @@
+#include "Archive.hpp"
+#include "Affinity.hpp"
+#include "Logger.hpp"
+#include "Tracer.hpp"
+#include "TreeWalk.hpp"
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <cctype>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+using std::string;
+using std::vector;
+
+// size of each frame's header, see Archive.hpp
+#define ARCHIVE_HEADER_LEN 32
+
+// extensions of files that won't get smaller, sent as they are
+static const char *compressed_extensions[] = {
+    ".gz", ".tgz", ".bz2", ".xz", ".zst", ".lz4", ".zip", ".7z", ".rar",
+    ".jpg", ".jpeg", ".png", ".gif", ".webp", ".mp3", ".mp4", ".mkv", ".webm"
+};
+
+// constructor
+// accepts connected data socket to send frames on, and the pool that
+// compresses pieces ahead of the one being sent
+Archive::Archive(Socketft *socket, ArchivePool *p)
+{
+    data_socket = socket;
+    pool = p;
+    root_fd = -1;
+    request_id = 0;
+    total_files = 0;
+    total_bytes = 0;
+    first_piece = 0;
+    next_piece = 0;
+    window_bytes = 0;
+    busy = 0;
+    failed = false;
+}
+
+// getter for number of files in archive
+uint64_t Archive::get_total_files()
+{
+    return total_files;
+}
+
+// getter for total size of files in archive, before compression
+uint64_t Archive::get_total_bytes()
+{
+    return total_bytes;
+}
+
+// true if path ends in the extension of an already compressed format
+bool Archive::is_compressed(const string &path)
+{
+    size_t dot = path.rfind('.');
+    if (dot == string::npos || path.find('/', dot) != string::npos)
+        return false;
+    string extension = path.substr(dot);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    for (size_t i = 0; i < sizeof(compressed_extensions) / sizeof(compressed_extensions[0]); i++)
+    {
+        if (extension == compressed_extensions[i])
+            return true;
+    }
+    return false;
+}
+
+/**************************************************
+ * queues the frames of one entry. a directory gets one frame, a regular
+ * file one frame for each ARCHIVE_PIECE bytes (at least one, so empty
+ * files are created). anything else is skipped
+ * Inputs:
+ *      - int, fd of directory containing entry
+ *      - const char *, name of entry
+ *      - const string &, path of directory relative to archive root
+ *      - bool &, set to true if entry is a directory
+ * Outputs:
+ *      - bool, false if connection failed, true otherwise
+**************************************************/
+bool Archive::add_entry(int dir_fd, const char *name, const string &prefix, bool &is_dir)
+{
+    struct stat stat_buffer;
+    is_dir = false;
+    string path = prefix + name;
+    if (fstatat(dir_fd, name, &stat_buffer, AT_SYMLINK_NOFOLLOW) < 0 || path.size() > UINT16_MAX)
+        return true;
+
+    Piece piece;
+    piece.encoding = ARCHIVE_STORED;
+    piece.passthrough = false;
+    piece.done = false;
+    piece.mode = stat_buffer.st_mode;
+    piece.mtime = stat_buffer.st_mtime;
+    piece.offset = 0;
+    piece.size = 0;
+    piece.path = path;
+    piece.charged = 0;
+
+    if (S_ISDIR(stat_buffer.st_mode))
+    {
+        is_dir = true;
+        piece.type = ARCHIVE_DIR;
+        piece.done = true;
+        return queue_piece(piece);
+    }
+    if (!S_ISREG(stat_buffer.st_mode))
+        return true;
+
+    piece.type = ARCHIVE_FILE;
+    piece.passthrough = is_compressed(path);
+    piece.done = piece.passthrough;     // nothing to compress
+    uint64_t file_len = stat_buffer.st_size;
+    total_files++;
+    total_bytes += file_len;
+    do
+    {
+        piece.size = std::min(file_len - piece.offset, (uint64_t)ARCHIVE_PIECE);
+        if (!queue_piece(piece))
+            return false;
+        piece.offset += piece.size;
+    } while (piece.offset < file_len);
+    return true;
+}
+
+// adds a piece to the queue for the pool to compress. once the queue is
+// full, pieces are sent until there is room, which holds up the walk
+bool Archive::queue_piece(const Piece &piece)
+{
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pieces.push_back(piece);
+    }
+    pool->changed.notify_all();
+    return send_ready(ARCHIVE_QUEUE_PIECES);
+}
+
+/**************************************************
+ * reads one piece of a file and compresses it as a zlib stream. the
+ * piece is stored instead if it doesn't get smaller. pieces sent with
+ * sendfile and directories have nothing to do
+ * Inputs:
+ *      - Piece &, piece to fill in
+ * Outputs:
+ *      - none. a file that can't be read, or got shorter, gets a piece
+ *        with the bytes that could be read
+**************************************************/
+void Archive::compress_piece(Piece &piece)
+{
+    if (piece.type != ARCHIVE_FILE || piece.passthrough || piece.size == 0)
+        return;
+    ScopedSpan span("compress");
+
+    vector<char> raw(piece.size);
+    size_t raw_len = 0;
+    int file_fd = openat(root_fd, piece.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    while (file_fd >= 0 && raw_len < raw.size())
+    {
+        ssize_t bytes_read = pread(file_fd, raw.data() + raw_len, raw.size() - raw_len,
+                                   piece.offset + raw_len);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            break;
+        raw_len += bytes_read;
+    }
+    if (file_fd >= 0)
+        close(file_fd);
+    piece.size = raw_len;
+
+    uLongf compressed_len = compressBound(raw_len);
+    piece.data.resize(compressed_len);
+    if (compress2((Bytef *)piece.data.data(), &compressed_len, (const Bytef *)raw.data(),
+                  raw_len, ARCHIVE_LEVEL) == Z_OK && compressed_len < raw_len)
+    {
+        piece.data.resize(compressed_len);
+        piece.encoding = ARCHIVE_DEFLATE;
+    }
+    else
+    {
+        raw.resize(raw_len);
+        piece.data.swap(raw);
+        piece.encoding = ARCHIVE_STORED;
+    }
+}
+
+/**************************************************
+ * sends one frame. passthrough pieces go from the file to the socket with
+ * sendfile, others send the data filled in by compress_piece, which is
+ * then freed. like compress_piece, a passthrough piece of a file that got
+ * shorter or can't be opened is sent with the bytes still there
+ * Inputs:
+ *      - Piece &, piece to send
+ * Outputs:
+ *      - bool, true if sent, false if connection failed
+**************************************************/
+bool Archive::send_piece(Piece &piece)
+{
+    const string &path = piece.path;
+
+    // header must give the size actually sent, not the size at scan time
+    int file_fd = -1;
+    if (piece.passthrough)
+    {
+        struct stat stat_buffer;
+        uint64_t available = 0;
+        file_fd = openat(root_fd, path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (file_fd >= 0 && fstat(file_fd, &stat_buffer) == 0 &&
+            (uint64_t)stat_buffer.st_size > piece.offset)
+            available = stat_buffer.st_size - piece.offset;
+        piece.size = std::min(piece.size, available);
+    }
+    uint64_t data_len = piece.passthrough ? piece.size : piece.data.size();
+
+    char len_buf[32];
+    int prefix_len = snprintf(len_buf, sizeof(len_buf), "%llu$",
+                              (unsigned long long)(ARCHIVE_HEADER_LEN + path.size() + data_len));
+
+    vector<char> head(prefix_len + ARCHIVE_HEADER_LEN + path.size());
+    char *header = head.data() + prefix_len;
+    uint16_t name_len = htons(path.size());
+    uint32_t mode = htonl(piece.mode);
+    uint64_t offset = htobe64(piece.offset);
+    uint64_t size = htobe64(piece.size);
+    uint64_t mtime = htobe64(piece.mtime);
+    memcpy(head.data(), len_buf, prefix_len);
+    header[0] = piece.type;
+    header[1] = piece.encoding;
+    memcpy(header + 2, &name_len, 2);
+    memcpy(header + 4, &mode, 4);
+    memcpy(header + 8, &offset, 8);
+    memcpy(header + 16, &size, 8);
+    memcpy(header + 24, &mtime, 8);
+    memcpy(header + ARCHIVE_HEADER_LEN, path.data(), path.size());
+
+    if (!data_socket->send_all(head.data(), head.size()))
+    {
+        if (file_fd >= 0)
+            close(file_fd);
+        return false;
+    }
+
+    if (!piece.passthrough)
+    {
+        bool sent = data_socket->send_all(piece.data.data(), piece.data.size());
+        vector<char>().swap(piece.data);
+        return sent;
+    }
+
+    // already compressed, straight from page cache
+    bool sent = (piece.size == 0 || data_socket->send_file(file_fd, piece.offset, piece.size));
+    if (file_fd >= 0)
+        close(file_fd);
+    return sent;
+}
+
+/**************************************************
+ * sends pieces from the front of the queue in order as each is finished,
+ * until no more than keep are left. a piece the pool hasn't taken yet is
+ * compressed here, so the sender never waits for room in the windows, and
+ * the archive is sent even when the pool is busy or empty
+ * Inputs:
+ *      - size_t, number of pieces to leave queued
+ * Outputs:
+ *      - bool, true if pieces sent, false if connection failed
+**************************************************/
+bool Archive::send_ready(size_t keep)
+{
+    // only this thread adds or removes pieces, so the front stays put and
+    // the size can be read without the lock
+    while (pieces.size() > keep)
+    {
+        Piece &piece = pieces.front();
+
+        // pieces are taken in order, so none after this one were taken
+        std::unique_lock<std::mutex> guard(pool->lock);
+        if (next_piece <= first_piece && !piece.done)
+        {
+            next_piece = first_piece + 1;
+            guard.unlock();
+            compress_piece(piece);
+            guard.lock();
+            piece.done = true;
+        }
+        pool->changed.wait(guard, [&piece]() { return piece.done; });
+        guard.unlock();
+
+        bool sent;
+        {
+            ScopedSpan span("send_data");
+            sent = send_piece(piece);
+        }
+
+        guard.lock();
+        window_bytes -= piece.charged;
+        pool->used_bytes -= piece.charged;
+        pieces.pop_front();
+        first_piece++;
+        next_piece = std::max(next_piece, first_piece);
+        if (!sent)
+            failed = true;
+        pool->changed.notify_all();
+        if (failed)
+            return false;
+    }
+    return true;
+}
+
+/**************************************************
+ * streams a directory tree as an archive, see Archive.hpp for format.
+ * the calling thread walks the tree and sends pieces in order, while the
+ * pool compresses the queued pieces after the one being sent
+ * Inputs:
+ *      - const char *, path of directory to archive
+ * Outputs:
+ *      - bool, true if complete archive sent, false if not
+**************************************************/
+bool Archive::send_archive(const char *path)
+{
+    root_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (root_fd < 0)
+        return false;
+
+    request_id = Tracer::get_request();
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->archives.push_back(this);
+    }
+
+    TreeWalk tree(root_fd, true);
+    bool ok = tree.walk([this](int dir_fd, const char *name, const string &prefix, bool &is_dir) {
+        return add_entry(dir_fd, name, prefix, is_dir);
+    }) && send_ready(0);
+
+    // pieces still being compressed are written into this archive, and
+    // pieces left unsent after a failure give their bytes back
+    {
+        std::unique_lock<std::mutex> guard(pool->lock);
+        pool->archives.remove(this);
+        pool->changed.wait(guard, [this]() { return busy == 0; });
+        pool->used_bytes -= window_bytes;
+        window_bytes = 0;
+        pieces.clear();
+    }
+    pool->changed.notify_all();
+    close(root_fd);
+    root_fd = -1;
+
+    if (!ok)
+        return false;
+
+    // end frame carries totals, so the client knows the archive is complete
+    Piece end;
+    end.type = ARCHIVE_END;
+    end.encoding = ARCHIVE_STORED;
+    end.passthrough = false;
+    end.done = true;
+    end.mode = 0;
+    end.mtime = 0;
+    end.offset = total_files;
+    end.size = total_bytes;
+    end.charged = 0;
+    return send_piece(end);
+}
+
+// constructor
+ArchivePool::ArchivePool()
+{
+    used_bytes = 0;
+    running = false;
+}
+
+// destructor
+// stops the threads, after the pieces they are compressing
+ArchivePool::~ArchivePool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+    }
+    changed.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+// starts the compressing threads, called once when the server starts
+void ArchivePool::start(int threads)
+{
+    running = true;
+    for (int i = 0; i < threads; i++)
+        workers.push_back(std::thread(&ArchivePool::work, this));
+    log_info("Compressing archives on %d threads", threads);
+}
+
+/**************************************************
+ * finds the next piece to compress, taking turns between archives. a
+ * piece is only taken if its bytes fit in its archive's window and in
+ * the budget for all archives. must be called with lock held
+ * Inputs:
+ *      - Archive *&, set to archive of piece taken
+ *      - Archive::Piece *&, set to piece taken, which stays queued until
+ *        it is done
+ * Outputs:
+ *      - bool, true if a piece was taken
+**************************************************/
+bool ArchivePool::take_piece(Archive *&archive, Archive::Piece *&piece)
+{
+    for (std::list<Archive *>::iterator it = archives.begin(); it != archives.end(); ++it)
+    {
+        Archive *candidate = *it;
+        std::deque<Archive::Piece> &pieces = candidate->pieces;
+        size_t end_piece = candidate->first_piece + pieces.size();
+
+        // directories and stored files have nothing to compress
+        while (candidate->next_piece < end_piece &&
+               pieces[candidate->next_piece - candidate->first_piece].done)
+            candidate->next_piece++;
+        if (candidate->failed || candidate->next_piece == end_piece)
+            continue;
+
+        Archive::Piece &next = pieces[candidate->next_piece - candidate->first_piece];
+        if (candidate->window_bytes + next.size > ARCHIVE_WINDOW_BYTES ||
+            used_bytes + next.size > ARCHIVE_BUDGET_BYTES)
+            continue;
+
+        archive = candidate;
+        piece = &next;
+        candidate->next_piece++;
+        next.charged = next.size;
+        candidate->window_bytes += next.size;
+        used_bytes += next.size;
+
+        // archive served goes to the back, so the next piece is another's
+        archives.splice(archives.end(), archives, it);
+        return true;
+    }
+    return false;
+}
+
+// compresses pieces of the archives being sent until the pool is stopped
+void ArchivePool::work()
+{
+    // threads start with the affinity of the thread that started the pool
+    Affinity::spread_thread();
+
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        Archive *archive = NULL;
+        Archive::Piece *piece = NULL;
+        changed.wait(guard, [&]() { return !running || take_piece(archive, piece); });
+        if (!running)
+            return;
+        archive->busy++;
+
+        // pieces behind it may be added or sent meanwhile, which leaves
+        // this one where it is in the deque
+        guard.unlock();
+        Tracer::set_request(archive->request_id);
+        archive->compress_piece(*piece);
+        guard.lock();
+
+        piece->done = true;
+        archive->busy--;
+        changed.notify_all();
+    }
+}
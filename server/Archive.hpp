@@ -0,0 +1,134 @@
+// Header file for Archive class
+#ifndef ARCHIVE_HPP
+#define ARCHIVE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "Socketft.hpp"
+
+using std::string;
+using std::vector;
+
+class ArchivePool;
+
+// files are split into pieces of this size, each compressed on its own
+#define ARCHIVE_PIECE (1 << 20)
+
+// zlib level, fast enough to keep up with the link on a few cores
+#define ARCHIVE_LEVEL 1
+
+// bytes of file data in pieces compressed but not yet sent, for one
+// archive and for all archives together
+#define ARCHIVE_WINDOW_BYTES (16 << 20)
+#define ARCHIVE_BUDGET_BYTES (64 << 20)
+
+// pieces found by the walk but not yet sent. the walk waits for pieces to
+// be sent once this many are queued, so a large tree isn't held in memory
+#define ARCHIVE_QUEUE_PIECES 1024
+
+// frame types
+#define ARCHIVE_DIR 1
+#define ARCHIVE_FILE 2
+#define ARCHIVE_END 3
+
+// encodings of a frame's data
+#define ARCHIVE_STORED 0
+#define ARCHIVE_DEFLATE 1
+
+/* streams a directory tree over a data socket as one archive. each frame
+* is a send_bytes message holding a 32 byte header, the entry's path
+* relative to the archived directory, and data:
+*      <type:1><encoding:1><name_len:2><mode:4><offset:8><size:8><mtime:8>
+* all integers in network byte order. a directory gets one frame with no
+* data. a file gets one frame for each ARCHIVE_PIECE bytes, with offset
+* and size of that piece. deflated data is a complete zlib stream, so
+* every frame can be decoded on its own. the last frame is ARCHIVE_END,
+* with the number of files in offset and their total size in size.
+* hidden entries, symlinks and special files are skipped, like listings.
+*
+* the tree is walked while it is sent. pieces are queued as the walk finds
+* them, compressed by the server's ArchivePool, and sent in order by the
+* calling thread as each is finished. files that are already
+* compressed are stored and sent straight from the page cache with sendfile
+*/
+class Archive
+{
+    friend class ArchivePool;
+    private:
+        // one frame to send. data is filled in by a compressing thread
+        struct Piece
+        {
+            uint8_t type;
+            uint8_t encoding;
+            bool passthrough;       // sent with sendfile, no data kept
+            bool done;
+            uint32_t mode;
+            int64_t mtime;
+            uint64_t offset;
+            uint64_t size;
+            string path;
+            uint64_t charged;       // bytes counted against windows until sent
+            vector<char> data;
+        };
+
+        Socketft *data_socket;
+        ArchivePool *pool;
+        int root_fd;
+        uint64_t request_id;
+        std::deque<Piece> pieces;   // found but not yet sent
+        uint64_t total_files;
+        uint64_t total_bytes;
+
+        // reorder buffer state, guarded by the pool's lock. pieces are
+        // numbered in the order found, the front of the queue is first_piece
+        size_t first_piece;
+        size_t next_piece;          // next piece to be compressed
+        uint64_t window_bytes;      // charged to pieces not yet sent
+        int busy;                   // pieces being compressed by the pool
+        bool failed;
+
+        bool add_entry(int dir_fd, const char *name, const string &prefix, bool &is_dir);
+        bool queue_piece(const Piece &piece);
+        void compress_piece(Piece &piece);
+        bool send_ready(size_t keep);
+        bool send_piece(Piece &piece);
+        static bool is_compressed(const string &path);
+    public:
+        Archive(Socketft *data_socket, ArchivePool *pool);
+        bool send_archive(const char *path);
+        uint64_t get_total_files();
+        uint64_t get_total_bytes();
+};
+
+/* threads that compress the pieces of every archive being sent. started
+* once with the server, so the number of compressing threads doesn't grow
+* with the number of clients. archives being sent take turns giving the
+* threads pieces
+*/
+class ArchivePool
+{
+    friend class Archive;
+    private:
+        std::mutex lock;            // also guards reorder state of archives
+        std::condition_variable changed;
+        vector<std::thread> workers;
+        std::list<Archive *> archives;
+        uint64_t used_bytes;        // charged to pieces not yet sent, all archives
+        bool running;
+
+        bool take_piece(Archive *&archive, Archive::Piece *&piece);
+        void work();
+    public:
+        ArchivePool();
+        ~ArchivePool();
+        void start(int threads);
+};
+
+#endif
@@ -0,0 +1,415 @@
+#include "Delta.hpp"
+#include "Affinity.hpp"
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <omp.h>
+
+using std::vector;
+
+// smallest amount of the file given to one scanning thread
+#define DELTA_MIN_SEGMENT (1 << 20)
+
+// largest block size accepted from a client signature
+#define DELTA_MAX_BLOCK (1 << 24)
+
+// writes a 32 bit value into buffer in network byte order
+static void put_u32(unsigned char *buffer, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(buffer, &value, 4);
+}
+
+// reads a 32 bit value in network byte order from buffer
+static uint32_t get_u32(const unsigned char *buffer)
+{
+    uint32_t value;
+    memcpy(&value, buffer, 4);
+    return ntohl(value);
+}
+
+// constructor, no signature or file loaded yet
+Delta::Delta()
+{
+    block_size = 0;
+    data = NULL;
+    file_len = 0;
+}
+
+// unmaps the scanned file, if any
+Delta::~Delta()
+{
+    if (data != NULL)
+        munmap((void *)data, file_len);
+}
+
+/**************************************************
+ * computes the rsync style weak checksum of a block. a is the sum of all
+ * bytes, b is the sum of the running values of a, each kept to 16 bits.
+ * the sums are written so the compiler can vectorize them.
+ * Inputs:
+ *      - const unsigned char *, start of block
+ *      - size_t, length of block
+ * Outputs:
+ *      - uint32_t, a in the low 16 bits and b in the high 16 bits
+**************************************************/
+uint32_t Delta::weak_checksum(const unsigned char *buffer, size_t len)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+
+    #pragma omp simd reduction(+:a,b)
+    for (size_t i = 0; i < len; i++)
+    {
+        a += buffer[i];
+        b += (uint32_t)(len - i) * buffer[i];
+    }
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+/**************************************************
+ * parses the block signature sent by the client for its existing copy.
+ * format, all values in network byte order:
+ *      <block_size:4><block_count:4> then for each block <weak:4><md5:16>
+ * only full sized blocks are included. the number of blocks is bounded by
+ * the signature's length, which the caller limits to DELTA_MAX_SIGNATURE
+ * Inputs:
+ *      - const char *, signature message
+ *      - size_t, length of message
+ * Outputs:
+ *      - bool, true if signature is valid, false if not
+**************************************************/
+bool Delta::parse_signature(const char *signature, size_t len)
+{
+    const unsigned char *sig = (const unsigned char *)signature;
+    const size_t entry_len = 4 + DELTA_STRONG_LEN;
+
+    if (len < 8)
+        return false;
+    block_size = get_u32(sig);
+    uint32_t block_count = get_u32(sig + 4);
+    if (block_size == 0 || block_size > DELTA_MAX_BLOCK)
+        return false;
+    if ((len - 8) / entry_len != block_count || (len - 8) % entry_len != 0)
+        return false;
+
+    blocks.resize(block_count);
+    sorted_blocks.resize(block_count);
+    weak_filter.assign(1 << 16, false);
+    for (uint32_t i = 0; i < block_count; i++)
+    {
+        const unsigned char *entry = sig + 8 + (size_t)i * entry_len;
+        blocks[i].weak = get_u32(entry);
+        memcpy(blocks[i].strong, entry + 4, DELTA_STRONG_LEN);
+        sorted_blocks[i] = i;
+        weak_filter[blocks[i].weak & 0xffff] = true;
+    }
+
+    // sort indexes by weak hash so candidates can be found by binary search.
+    // stable so blocks with equal hashes stay in file order
+    const vector<BlockSig> &b = blocks;
+    std::stable_sort(sorted_blocks.begin(), sorted_blocks.end(),
+        [&b](uint32_t x, uint32_t y) { return b[x].weak < b[y].weak; });
+    return true;
+}
+
+/**************************************************
+ * looks for a block of the client's copy matching the window at the given
+ * offset of the new file. the client rebuilds the file in place, so only
+ * blocks at or after the offset can be used (anything before it has
+ * already been overwritten). a block at exactly the same offset is
+ * preferred since the client doesn't need to write it at all.
+ * Inputs:
+ *      - uint64_t, offset of the window in the new file
+ *      - uint32_t, weak checksum of the window
+ * Outputs:
+ *      - int, index of matching block, or -1 if none
+**************************************************/
+int Delta::find_block(uint64_t offset, uint32_t weak)
+{
+    if (!weak_filter[weak & 0xffff])
+        return -1;
+
+    const vector<BlockSig> &b = blocks;
+    vector<uint32_t>::iterator it = std::lower_bound(sorted_blocks.begin(),
+        sorted_blocks.end(), weak,
+        [&b](uint32_t x, uint32_t w) { return b[x].weak < w; });
+
+    unsigned char strong[EVP_MAX_MD_SIZE];
+    bool have_strong = false;
+    int found = -1;
+    for (; it != sorted_blocks.end() && blocks[*it].weak == weak; ++it)
+    {
+        uint64_t block_offset = (uint64_t)*it * block_size;
+        if (block_offset < offset)
+            continue;
+
+        // only compute the strong hash once a weak match is found
+        if (!have_strong)
+        {
+            EVP_Digest(data + offset, block_size, strong, NULL, EVP_md5(), NULL);
+            have_strong = true;
+        }
+        if (memcmp(strong, blocks[*it].strong, DELTA_STRONG_LEN) == 0)
+        {
+            found = *it;
+            if (block_offset == offset)
+                break;
+        }
+    }
+    return found;
+}
+
+/**************************************************
+ * scans one segment of the new file with the rolling checksum, producing
+ * literal and block reference ops. a match may start anywhere before end
+ * and run past it, the merge step trims the overlap with the next segment.
+ * Inputs:
+ *      - uint64_t, start offset of segment
+ *      - uint64_t, end offset of segment
+ *      - vector<DeltaOp>&, receives the ops for this segment
+ * Outputs:
+ *      - no return value
+**************************************************/
+void Delta::scan_segment(uint64_t start, uint64_t end, vector<DeltaOp> &seg_ops)
+{
+    uint64_t pos = start;
+    uint64_t literal_start = start;
+    uint32_t a = 0, b = 0;
+    bool window_valid = false;
+
+    while (pos < end && pos + block_size <= file_len)
+    {
+        if (!window_valid)
+        {
+            uint32_t weak = weak_checksum(data + pos, block_size);
+            a = weak & 0xffff;
+            b = weak >> 16;
+            window_valid = true;
+        }
+
+        int index = find_block(pos, (a & 0xffff) | ((b & 0xffff) << 16));
+        if (index >= 0)
+        {
+            if (literal_start < pos)
+            {
+                DeltaOp lit = { true, literal_start, pos - literal_start, 0 };
+                seg_ops.push_back(lit);
+            }
+            DeltaOp ref = { false, pos, block_size, (uint32_t)index };
+            seg_ops.push_back(ref);
+            pos += block_size;
+            literal_start = pos;
+            window_valid = false;
+            continue;
+        }
+
+        // roll window forward one byte
+        if (pos + block_size < file_len)
+        {
+            a = a - data[pos] + data[pos + block_size];
+            b = b - block_size * data[pos] + a;
+        }
+        pos++;
+    }
+
+    // rest of segment had no matches
+    if (literal_start < end)
+    {
+        DeltaOp lit = { true, literal_start, end - literal_start, 0 };
+        seg_ops.push_back(lit);
+    }
+}
+
+// appends a literal op, joining it with the previous op if adjacent
+void Delta::add_literal(uint64_t offset, uint64_t len)
+{
+    if (!ops.empty() && ops.back().literal &&
+        ops.back().offset + ops.back().len == offset)
+    {
+        ops.back().len += len;
+        return;
+    }
+    DeltaOp lit = { true, offset, len, 0 };
+    ops.push_back(lit);
+}
+
+/**************************************************
+ * joins the ops of each segment into a single list covering the file
+ * exactly once. anything already covered by the end of the previous
+ * segment is dropped, block references that are only partly covered
+ * become literals.
+ * Inputs:
+ *      - vector of op vectors, one per segment, in file order
+ * Outputs:
+ *      - no return value, ops member contains merged list
+**************************************************/
+void Delta::merge_segments(vector< vector<DeltaOp> > &segments)
+{
+    uint64_t covered = 0;
+    ops.clear();
+    for (size_t s = 0; s < segments.size(); s++)
+    {
+        for (size_t i = 0; i < segments[s].size(); i++)
+        {
+            DeltaOp &op = segments[s][i];
+            uint64_t op_end = op.offset + op.len;
+            if (op_end <= covered)
+                continue;
+
+            if (!op.literal && op.offset >= covered)
+                ops.push_back(op);
+            else
+            {
+                uint64_t start = std::max(op.offset, covered);
+                add_literal(start, op_end - start);
+            }
+            covered = op_end;
+        }
+    }
+}
+
+/**************************************************
+ * maps the requested file and computes the delta against the client's
+ * signature. the file is split into segments that are scanned in parallel.
+ * Inputs:
+ *      - const char *, name of file to scan
+ * Outputs:
+ *      - bool, true if delta computed, false if file couldn't be read
+**************************************************/
+bool Delta::compute(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat stat_buffer;
+    if (fstat(fd, &stat_buffer) < 0)
+    {
+        close(fd);
+        return false;
+    }
+    file_len = stat_buffer.st_size;
+
+    ops.clear();
+    if (file_len == 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    void *mapped = mmap(NULL, file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        file_len = 0;
+        return false;
+    }
+    data = (const unsigned char *)mapped;
+    madvise(mapped, file_len, MADV_SEQUENTIAL);
+    madvise(mapped, file_len, MADV_WILLNEED);
+
+    // nothing to match against, whole file is one literal
+    if (blocks.empty())
+    {
+        add_literal(0, file_len);
+        return true;
+    }
+
+    // split file into roughly equal segments, one or more per thread
+    uint64_t min_segment = std::max((uint64_t)DELTA_MIN_SEGMENT, (uint64_t)block_size * 4);
+    uint64_t num_segments = std::min((uint64_t)omp_get_max_threads() * 4,
+                                     (file_len + min_segment - 1) / min_segment);
+    if (num_segments == 0)
+        num_segments = 1;
+    uint64_t segment_len = (file_len + num_segments - 1) / num_segments;
+
+    vector< vector<DeltaOp> > segments(num_segments);
+
+    #pragma omp parallel
+    {
+        // new threads start on the calling thread's CPU when it is pinned
+        if (omp_get_thread_num() != 0)
+            Affinity::spread_thread();
+
+        #pragma omp for schedule(dynamic, 1)
+        for (long s = 0; s < (long)num_segments; s++)
+        {
+            uint64_t start = s * segment_len;
+            uint64_t end = std::min(file_len, start + segment_len);
+            if (start < end)
+                scan_segment(start, end, segments[s]);
+        }
+    }
+
+    merge_segments(segments);
+    return true;
+}
+
+// returns number of bytes that will be sent as literals
+uint64_t Delta::literal_bytes()
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        if (ops[i].literal)
+            total += ops[i].len;
+    }
+    return total;
+}
+
+/**************************************************
+ * streams the delta over the data connection. format, all values in
+ * network byte order:
+ *      <file_len_high:4><file_len_low:4>
+ *      then any number of:
+ *          "L"<len:4><len bytes>   literal bytes, written at current offset
+ *          "B"<index:4>            block of client's old copy
+ *      then "E" to mark the end
+ * Inputs:
+ *      - Socketft *, connected data socket
+ * Outputs:
+ *      - bool, true if entire delta sent, false if not
+**************************************************/
+bool Delta::send(Socketft *data_socket)
+{
+    unsigned char header[8];
+    put_u32(header, (uint32_t)(file_len >> 32));
+    put_u32(header + 4, (uint32_t)file_len);
+    if (!data_socket->send_all((const char *)header, sizeof(header)))
+        return false;
+
+    unsigned char record[5];
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        if (!ops[i].literal)
+        {
+            record[0] = 'B';
+            put_u32(record + 1, ops[i].index);
+            if (!data_socket->send_all((const char *)record, sizeof(record)))
+                return false;
+            continue;
+        }
+
+        // split long literals into several records
+        uint64_t sent = 0;
+        while (sent < ops[i].len)
+        {
+            uint32_t chunk = (uint32_t)std::min((uint64_t)DELTA_MAX_LITERAL, ops[i].len - sent);
+            record[0] = 'L';
+            put_u32(record + 1, chunk);
+            if (!data_socket->send_all((const char *)record, sizeof(record)) ||
+                !data_socket->send_all((const char *)data + ops[i].offset + sent, chunk))
+                return false;
+            sent += chunk;
+        }
+    }
+
+    return data_socket->send_all("E", 1);
+}
@@ -0,0 +1,64 @@
+// Header file for Delta class
+#ifndef DELTA_HPP
+#define DELTA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "Socketft.hpp"
+
+using std::vector;
+
+// size of the strong (md5) hash stored for each block
+#define DELTA_STRONG_LEN 16
+
+// max number of literal bytes sent in a single literal record
+#define DELTA_MAX_LITERAL (1 << 20)
+
+// largest signature accepted from a client, about 3 million blocks
+#define DELTA_MAX_SIGNATURE (64 << 20)
+
+class Delta
+{
+    private:
+        // one block of the client's existing copy, from its signature
+        struct BlockSig
+        {
+            uint32_t weak;
+            unsigned char strong[DELTA_STRONG_LEN];
+        };
+
+        // one instruction for rebuilding the file. a literal copies len bytes
+        // of the new file starting at offset, a block reference copies block
+        // index of the client's old copy to offset
+        struct DeltaOp
+        {
+            bool literal;
+            uint64_t offset;
+            uint64_t len;
+            uint32_t index;
+        };
+
+        uint32_t block_size;
+        vector<BlockSig> blocks;
+        vector<uint32_t> sorted_blocks;     // block indexes sorted by weak hash
+        vector<bool> weak_filter;           // bit set for low 16 bits of each weak hash
+        vector<DeltaOp> ops;
+        const unsigned char *data;          // mmap'd contents of the new file
+        uint64_t file_len;
+
+        int find_block(uint64_t offset, uint32_t weak);
+        void scan_segment(uint64_t start, uint64_t end, vector<DeltaOp> &seg_ops);
+        void merge_segments(vector< vector<DeltaOp> > &segments);
+        void add_literal(uint64_t offset, uint64_t len);
+    public:
+        Delta();
+        ~Delta();
+        bool parse_signature(const char *signature, size_t len);
+        bool compute(const char *filename);
+        bool send(Socketft *data_socket);
+        uint64_t literal_bytes();
+        static uint32_t weak_checksum(const unsigned char *buffer, size_t len);
+};
+
+#endif
@@ -0,0 +1,163 @@
+#include "DirListing.hpp"
+#include "TreeWalk.hpp"
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+using std::string;
+using std::vector;
+
+// constructor
+// accepts connected data socket to send pages on, and whether to
+// descend into subdirectories
+DirListing::DirListing(Socketft *socket, bool r)
+{
+    data_socket = socket;
+    recursive = r;
+    root_fd = -1;
+    total_entries = 0;
+}
+
+// getter for number of entries sent so far
+uint64_t DirListing::get_total_entries()
+{
+    return total_entries;
+}
+
+/**************************************************
+ * sends the current page of records as one framed message and clears it.
+ * format: <count:4><names_len:4> then count 40 byte records, then the
+ * name table. all integers in network byte order. an empty page marks
+ * the end of the listing
+ * Inputs:
+ *      - none, uses records and names members
+ * Outputs:
+ *      - bool, true if sent, false if connection failed
+**************************************************/
+bool DirListing::send_page()
+{
+    size_t records_len = records.size() * sizeof(EntryRecord);
+    vector<char> page(8 + records_len + names.size());
+
+    uint32_t count = htonl(records.size());
+    uint32_t names_len = htonl(names.size());
+    memcpy(&page[0], &count, 4);
+    memcpy(&page[4], &names_len, 4);
+    if (records_len > 0)
+        memcpy(&page[8], records.data(), records_len);
+    if (!names.empty())
+        memcpy(&page[8 + records_len], names.data(), names.size());
+
+    total_entries += records.size();
+    records.clear();
+    names.clear();
+    return data_socket->send_bytes(page.data(), page.size());
+}
+
+/**************************************************
+ * gets metadata for one entry with statx relative to its directory's fd,
+ * and adds a record for it to the current page. sends the page when full
+ * Inputs:
+ *      - int, fd of directory containing entry
+ *      - const char *, name of entry
+ *      - const string &, path of directory relative to listing root
+ *      - bool &, set to true if entry is a directory
+ * Outputs:
+ *      - bool, false if connection failed, true otherwise. entries that
+ *        can't be stat'd (removed during scan), or whose path doesn't fit
+ *        in name_len, are skipped
+**************************************************/
+bool DirListing::add_entry(int dir_fd, const char *name, const string &prefix, bool &is_dir)
+{
+    struct statx stx;
+    is_dir = false;
+    string path = prefix + name;
+    if (path.size() > UINT16_MAX)
+        return true;
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+              STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO, &stx) < 0)
+        return true;
+    is_dir = S_ISDIR(stx.stx_mode);
+
+    EntryRecord record;
+    record.size = htobe64(stx.stx_size);
+    record.mtime_sec = htobe64(stx.stx_mtime.tv_sec);
+    record.mtime_nsec = htonl(stx.stx_mtime.tv_nsec);
+    record.mode = htonl(stx.stx_mode);
+    record.inode = htobe64(stx.stx_ino);
+    record.name_offset = htonl(names.size());
+    record.name_len = htons(path.size());
+    record.reserved = 0;
+    records.push_back(record);
+    names += path;
+
+    if (records.size() == LISTING_PAGE_ENTRIES)
+        return send_page();
+    return true;
+}
+
+/**************************************************
+ * size of a non-recursive listing of a directory as send_listing sends
+ * it, from one pass over its names. entries aren't stat'd, so this is
+ * cheap enough to decide how to schedule a listing before it runs
+ * Inputs:
+ *      - const char *, path of directory
+ * Outputs:
+ *      - uint64_t, size in bytes, 0 if directory can't be read
+**************************************************/
+uint64_t DirListing::listing_size(const char *path)
+{
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        return 0;
+
+    uint64_t entries = 0;
+    uint64_t names_len = 0;
+    TreeWalk tree(dir_fd, false);
+    tree.walk([&](int, const char *name, const string &, bool &) {
+        entries++;
+        names_len += strlen(name);
+        return true;
+    });
+    close(dir_fd);
+
+    // pages holding entries, and the empty page ending the listing
+    uint64_t pages = (entries + LISTING_PAGE_ENTRIES - 1) / LISTING_PAGE_ENTRIES + 1;
+    return pages * 8 + entries * sizeof(EntryRecord) + names_len;
+}
+
+/**************************************************
+ * streams a listing of a directory over the data socket in pages, so the
+ * first entries are sent before the scan finishes. subdirectories are
+ * visited depth first when the listing is recursive, see TreeWalk. only
+ * the current page and the paths of directories waiting to be visited
+ * are kept in memory
+ * Inputs:
+ *      - const char *, path of directory to list
+ * Outputs:
+ *      - bool, true if complete listing sent, false if not
+**************************************************/
+bool DirListing::send_listing(const char *path)
+{
+    root_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0)
+        return false;
+
+    TreeWalk tree(root_fd, recursive);
+    bool ok = tree.walk([this](int dir_fd, const char *name, const string &prefix, bool &is_dir) {
+        return add_entry(dir_fd, name, prefix, is_dir);
+    });
+    close(root_fd);
+    root_fd = -1;
+
+    // send last partial page, then empty page to mark the end
+    if (ok && !records.empty())
+        ok = send_page();
+    if (ok)
+        ok = send_page();
+    return ok;
+}
@@ -0,0 +1,51 @@
+// Header file for DirListing class
+#ifndef DIRLISTING_HPP
+#define DIRLISTING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Socketft.hpp"
+
+using std::string;
+using std::vector;
+
+// number of entries sent in each page of a listing
+#define LISTING_PAGE_ENTRIES 1024
+
+class DirListing
+{
+    private:
+        // fixed size record for one entry, all fields in network byte order.
+        // name_offset and name_len locate the entry's path in the page's
+        // name table, which follows the records
+        struct EntryRecord
+        {
+            uint64_t size;
+            int64_t mtime_sec;
+            uint32_t mtime_nsec;
+            uint32_t mode;
+            uint64_t inode;
+            uint32_t name_offset;
+            uint16_t name_len;
+            uint16_t reserved;
+        };
+
+        Socketft *data_socket;
+        bool recursive;
+        int root_fd;
+        vector<EntryRecord> records;
+        string names;
+        uint64_t total_entries;
+
+        bool add_entry(int dir_fd, const char *name, const string &prefix, bool &is_dir);
+        bool send_page();
+    public:
+        DirListing(Socketft *data_socket, bool recursive);
+        bool send_listing(const char *path);
+        static uint64_t listing_size(const char *path);
+        uint64_t get_total_entries();
+};
+
+#endif
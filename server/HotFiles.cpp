@@ -0,0 +1,269 @@
+#include "HotFiles.hpp"
+#include "Logger.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// bytes read synchronously ahead of the first read, the rest of the file
+// is left to the kernel's async read-ahead
+#define HOT_READAHEAD_BYTES (2 * 1024 * 1024)
+
+// constructor
+HotFiles::HotFiles()
+{
+    accesses_since_save = 0;
+    save_pending = false;
+    running = false;
+}
+
+// stops background thread, after it finishes any save in progress
+HotFiles::~HotFiles()
+{
+    if (!saver.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+    }
+    save_wanted.notify_one();
+    saver.join();
+}
+
+// starts background thread that saves the access log when record asks
+void HotFiles::start()
+{
+    running = true;
+    saver = std::thread(&HotFiles::save_loop, this);
+}
+
+// waits for saves requested by record, and writes the access log
+void HotFiles::save_loop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        save_wanted.wait(guard, [this]() { return save_pending || !running; });
+        if (!running)
+            return;
+        save_pending = false;
+        guard.unlock();
+        save();
+        guard.lock();
+    }
+}
+
+// score of an entry at time now, halved for every half life since its
+// last access
+double HotFiles::decayed(const HotEntry &entry, time_t now)
+{
+    double age = (now > entry.last_access) ? (double)(now - entry.last_access) : 0;
+    return entry.score * std::exp2(-age / HOT_HALF_LIFE_SEC);
+}
+
+/**************************************************
+ * gives the kernel read hints for a file that is about to be read from
+ * start to end: sequential access, so read-ahead is more aggressive, and
+ * will need, so reading the whole file starts now. the start of the file
+ * is read into the page cache before returning, so the first read
+ * doesn't wait on the disk
+ * Inputs:
+ *      - int, open file descriptor
+ *      - off_t, length of file
+ * Outputs:
+ *      - no return value
+**************************************************/
+void HotFiles::prepare_read(int fd, off_t len)
+{
+    if (fd < 0 || len <= 0)
+        return;
+    posix_fadvise(fd, 0, len, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    readahead(fd, 0, std::min(len, (off_t)HOT_READAHEAD_BYTES));
+}
+
+// counts a get of a file. every HOT_SAVE_EVERY gets, the background
+// thread is asked to save the access log, so the request doesn't wait on it
+void HotFiles::record(const char *filename)
+{
+    time_t now = time(NULL);
+    bool save_now = false;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        HotEntry &entry = entries[filename];
+        entry.score = decayed(entry, now) + 1;
+        entry.last_access = now;
+        if (++accesses_since_save >= HOT_SAVE_EVERY && running)
+        {
+            accesses_since_save = 0;
+            save_pending = true;
+            save_now = true;
+        }
+    }
+    if (save_now)
+        save_wanted.notify_one();
+}
+
+// names of up to count files with the highest current scores, hottest first
+vector<string> HotFiles::top(size_t count)
+{
+    time_t now = time(NULL);
+    vector< std::pair<double, string> > scored;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (map<string, HotEntry>::iterator it = entries.begin(); it != entries.end(); ++it)
+            scored.push_back(std::make_pair(decayed(it->second, now), it->first));
+    }
+
+    count = std::min(count, scored.size());
+    std::partial_sort(scored.begin(), scored.begin() + count, scored.end(),
+                      std::greater< std::pair<double, string> >());
+
+    vector<string> names;
+    for (size_t i = 0; i < count; i++)
+        names.push_back(scored[i].second);
+    return names;
+}
+
+/**************************************************
+ * writes current scores to the access log, one "<score> <last access>
+ * <name>" line per file. written to a temp file and renamed, so a crash
+ * never leaves a partial log. files that have gone cold are dropped.
+ * only called by the background thread
+ * Inputs:
+ *      - none
+ * Outputs:
+ *      - no return value
+**************************************************/
+void HotFiles::save()
+{
+    time_t now = time(NULL);
+    string contents;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        map<string, HotEntry>::iterator it = entries.begin();
+        while (it != entries.end())
+        {
+            double score = decayed(it->second, now);
+            if (score < HOT_MIN_SCORE)
+            {
+                entries.erase(it++);
+                continue;
+            }
+            char line[64];
+            snprintf(line, sizeof(line), "%.4f %lld ", it->second.score,
+                     (long long)it->second.last_access);
+            contents += line + it->first + "\n";
+            ++it;
+        }
+    }
+
+    string temp_name = string(HOT_LOG_NAME) + ".tmp";
+    FILE *fp = fopen(temp_name.c_str(), "w");
+    if (fp == NULL)
+    {
+        log_warn("unable to save access log");
+        return;
+    }
+    bool written = fwrite(contents.data(), 1, contents.size(), fp) == contents.size();
+    written = (fclose(fp) == 0) && written;
+    if (!written || rename(temp_name.c_str(), HOT_LOG_NAME) < 0)
+    {
+        log_warn("unable to save access log");
+        unlink(temp_name.c_str());
+    }
+}
+
+// reads scores saved by a previous run, if there are any
+void HotFiles::load()
+{
+    FILE *fp = fopen(HOT_LOG_NAME, "r");
+    if (fp == NULL)
+        return;
+
+    char line[512];
+    std::lock_guard<std::mutex> guard(lock);
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        double score;
+        long long last_access;
+        int name_start = 0;
+        if (sscanf(line, "%lf %lld %n", &score, &last_access, &name_start) < 2 || name_start == 0)
+            continue;
+
+        char *name = line + name_start;
+        name[strcspn(name, "\n")] = '\0';
+        if (name[0] == '\0')
+            continue;
+        HotEntry &entry = entries[name];
+        entry.score = score;
+        entry.last_access = last_access;
+    }
+    fclose(fp);
+    log_info("Loaded access counts of %llu files", (unsigned long long)entries.size());
+}
+
+/**************************************************
+ * loads the page cache with the count hottest files from the saved access
+ * log, on a background thread so the server can start accepting clients
+ * right away
+ * Inputs:
+ *      - size_t, number of files to load
+ * Outputs:
+ *      - no return value
+**************************************************/
+void HotFiles::prewarm(size_t count)
+{
+    vector<string> names = top(count);
+    if (names.empty())
+        return;
+
+    std::thread warmer([names]()
+    {
+        unsigned long long warmed = 0;
+        unsigned long long total = 0;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            int fd = open(names[i].c_str(), O_RDONLY);
+            if (fd < 0)
+                continue;
+            struct stat stat_buffer;
+            if (fstat(fd, &stat_buffer) == 0 && S_ISREG(stat_buffer.st_mode))
+            {
+                posix_fadvise(fd, 0, stat_buffer.st_size, POSIX_FADV_WILLNEED);
+                readahead(fd, 0, stat_buffer.st_size);
+                warmed++;
+                total += stat_buffer.st_size;
+            }
+            close(fd);
+        }
+        log_info("Pre-warmed %llu hot files (%llu bytes)", warmed, total);
+    });
+    warmer.detach();
+}
+
+// current scores of up to count hottest files, for control status
+string HotFiles::status(size_t count)
+{
+    vector<string> names = top(count);
+    time_t now = time(NULL);
+    string result;
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        map<string, HotEntry>::iterator it = entries.find(names[i]);
+        if (it == entries.end())
+            continue;
+        char score[32];
+        snprintf(score, sizeof(score), "=%.2f", decayed(it->second, now));
+        if (!result.empty())
+            result += " ";
+        result += names[i] + score;
+    }
+    return result.empty() ? "none" : result;
+}
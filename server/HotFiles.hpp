@@ -0,0 +1,68 @@
+// Header file for HotFiles class
+#ifndef HOTFILES_HPP
+#define HOTFILES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <sys/types.h>
+
+using std::string;
+using std::vector;
+using std::map;
+
+// file in served directory that access counts are saved to. hidden, so
+// it is never listed or sent
+#define HOT_LOG_NAME ".ftserver_access"
+
+// an access counts half as much after this many seconds
+#define HOT_HALF_LIFE_SEC 3600
+
+// access log is rewritten after this many gets
+#define HOT_SAVE_EVERY 64
+
+// number of files shown by control command
+#define HOT_STATUS_FILES 10
+
+// files whose score falls below this are forgotten
+#define HOT_MIN_SCORE 0.01
+
+// access frequency of one file, decayed by time since last access
+struct HotEntry
+{
+    double score;
+    time_t last_access;
+};
+
+class HotFiles
+{
+    private:
+        std::mutex lock;
+        map<string, HotEntry> entries;
+        unsigned accesses_since_save;
+        std::thread saver;                  // writes access log off the request path
+        std::condition_variable save_wanted;
+        bool save_pending;
+        bool running;
+
+        static double decayed(const HotEntry &entry, time_t now);
+        void save();
+        void save_loop();
+    public:
+        HotFiles();
+        ~HotFiles();
+        void start();
+        void record(const char *filename);
+        vector<string> top(size_t count);
+        void load();
+        void prewarm(size_t count);
+        string status(size_t count);
+        static void prepare_read(int fd, off_t len);
+};
+
+#endif
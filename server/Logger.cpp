@@ -0,0 +1,419 @@
+#include "Logger.hpp"
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <unistd.h>
+
+// size of buffer formatted records are collected in before each write
+#define LOG_BATCH_SIZE (64 * 1024)
+
+// how long the background thread sleeps when there is nothing to write
+#define LOG_IDLE_SLEEP_MS 2
+
+std::atomic<int> Logger::level(LOG_INFO);
+std::atomic<int> Logger::num_rings(0);
+LogRing *Logger::rings[LOG_MAX_THREADS];
+std::atomic<bool> Logger::running(false);
+
+// registration of new rings is the only place a lock is taken, once per thread
+static std::mutex register_lock;
+static std::thread drain_thread;
+
+// rings of threads that have exited, given to the next threads to log.
+// guarded by register_lock
+static std::vector<LogRing *> free_rings;
+
+// the calling thread's ring, handed back to free_rings when it exits.
+// anything the thread logs after that is dropped
+struct RingHolder
+{
+    LogRing *ring;
+    bool registered;
+
+    ~RingHolder()
+    {
+        if (ring == NULL)
+            return;
+        std::lock_guard<std::mutex> guard(register_lock);
+        free_rings.push_back(ring);
+        ring = NULL;
+    }
+};
+static thread_local RingHolder holder = { NULL, false };
+
+static const char *level_names[] = { "ERROR", "WARN ", "INFO ", "DEBUG" };
+
+// writes whole buffer to fd, nothing can be done about errors here
+static void write_all(int fd, const char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buffer, len);
+        if (written <= 0)
+            return;
+        buffer += written;
+        len -= written;
+    }
+}
+
+// sets lowest severity that is logged, LOG_ERROR to LOG_DEBUG
+void Logger::set_level(int new_level)
+{
+    if (new_level < LOG_ERROR)
+        new_level = LOG_ERROR;
+    if (new_level > LOG_DEBUG)
+        new_level = LOG_DEBUG;
+    level.store(new_level, std::memory_order_relaxed);
+}
+
+// getter for current log level
+int Logger::get_level()
+{
+    return level.load(std::memory_order_relaxed);
+}
+
+// true if messages of the given level are currently logged
+bool Logger::enabled(int msg_level)
+{
+    return msg_level <= level.load(std::memory_order_relaxed);
+}
+
+// returns the calling thread's ring on first use, reusing the ring of a
+// thread that exited or else creating and registering one. returns NULL
+// if too many threads are logging
+LogRing *Logger::thread_ring()
+{
+    if (holder.registered)
+        return holder.ring;
+
+    std::lock_guard<std::mutex> guard(register_lock);
+    holder.registered = true;
+    if (!free_rings.empty())
+    {
+        // the drain thread keeps consuming it where the exited thread stopped
+        holder.ring = free_rings.back();
+        free_rings.pop_back();
+        return holder.ring;
+    }
+
+    int index = num_rings.load(std::memory_order_relaxed);
+    if (index == LOG_MAX_THREADS)
+        return NULL;
+
+    LogRing *ring = new LogRing;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->dropped.store(0, std::memory_order_relaxed);
+    rings[index] = ring;
+    num_rings.store(index + 1, std::memory_order_release);
+    holder.ring = ring;
+    return ring;
+}
+
+/**************************************************
+ * reserves the next record in the calling thread's ring and fills in its
+ * header. must be followed by commit_record once arguments are added
+ * Inputs:
+ *      - int, log level of message
+ *      - const char *, format string literal
+ * Outputs:
+ *      - LogRecord *, record to add arguments to, or NULL if the ring is
+ *        full, in which case the message is counted as dropped
+**************************************************/
+LogRecord *Logger::begin_record(int msg_level, const char *fmt)
+{
+    LogRing *ring = thread_ring();
+    if (ring == NULL)
+        return NULL;
+
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == LOG_RING_RECORDS)
+    {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    LogRecord *record = &ring->records[head % LOG_RING_RECORDS];
+    record->timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record->fmt = fmt;
+    record->level = msg_level;
+    record->num_args = 0;
+    record->used = 0;
+    return record;
+}
+
+// publishes the record reserved by begin_record to the background thread
+void Logger::commit_record()
+{
+    LogRing *ring = thread_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+// stores a signed integer argument
+void Logger::add_arg(LogRecord *record, long long value)
+{
+    if ((size_t)record->used + 9 > sizeof(record->payload))
+        return;
+    record->payload[record->used] = LOG_ARG_INT;
+    memcpy(record->payload + record->used + 1, &value, 8);
+    record->used += 9;
+    record->num_args++;
+}
+
+// stores an unsigned integer argument
+void Logger::add_arg(LogRecord *record, unsigned long long value)
+{
+    if ((size_t)record->used + 9 > sizeof(record->payload))
+        return;
+    record->payload[record->used] = LOG_ARG_UINT;
+    memcpy(record->payload + record->used + 1, &value, 8);
+    record->used += 9;
+    record->num_args++;
+}
+
+// stores a floating point argument
+void Logger::add_arg(LogRecord *record, double value)
+{
+    if ((size_t)record->used + 9 > sizeof(record->payload))
+        return;
+    record->payload[record->used] = LOG_ARG_DOUBLE;
+    memcpy(record->payload + record->used + 1, &value, 8);
+    record->used += 9;
+    record->num_args++;
+}
+
+// copies a string argument into the record, truncated to fit
+void Logger::add_arg(LogRecord *record, const char *value)
+{
+    if (value == NULL)
+        value = "(null)";
+    if ((size_t)record->used + 3 > sizeof(record->payload))
+        return;
+    size_t room = sizeof(record->payload) - record->used - 3;
+    uint16_t len = std::min(strlen(value), room);
+    record->payload[record->used] = LOG_ARG_STRING;
+    memcpy(record->payload + record->used + 1, &len, 2);
+    memcpy(record->payload + record->used + 3, value, len);
+    record->used += 3 + len;
+    record->num_args++;
+}
+
+/**************************************************
+ * formats one record into a line of text. each conversion in the format
+ * string is printed with snprintf using the next stored argument, integer
+ * length modifiers are replaced to match the 64 bit stored values.
+ * Inputs:
+ *      - const LogRecord &, record to format
+ *      - char *, output buffer
+ *      - size_t, size of output buffer
+ * Outputs:
+ *      - size_t, number of chars written, line ends with newline
+**************************************************/
+size_t Logger::format_record(const LogRecord &record, char *out, size_t out_len)
+{
+    // timestamp and level prefix
+    time_t seconds = record.timestamp_ns / 1000000000ULL;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    size_t len = strftime(out, out_len, "%Y-%m-%d %H:%M:%S", &local);
+    len += snprintf(out + len, out_len - len, ".%03u %s ",
+                    (unsigned)(record.timestamp_ns / 1000000 % 1000), level_names[record.level]);
+
+    const char *fmt = record.fmt;
+    size_t arg_pos = 0;
+    while (*fmt != '\0' && len < out_len - 2)
+    {
+        if (*fmt != '%')
+        {
+            out[len++] = *fmt++;
+            continue;
+        }
+        if (fmt[1] == '%')
+        {
+            out[len++] = '%';
+            fmt += 2;
+            continue;
+        }
+
+        // copy flags, width and precision, skip length modifiers
+        char spec[32];
+        size_t spec_len = 0;
+        spec[spec_len++] = *fmt++;
+        while (*fmt != '\0' && strchr("-+ #0123456789.", *fmt) != NULL && spec_len < 20)
+            spec[spec_len++] = *fmt++;
+        while (*fmt != '\0' && strchr("hlLqjzt", *fmt) != NULL)
+            fmt++;
+        char conversion = *fmt;
+        if (conversion == '\0')
+            break;
+        fmt++;
+
+        // no argument left for this conversion
+        if (arg_pos >= record.used)
+        {
+            len += snprintf(out + len, out_len - len, "?");
+            continue;
+        }
+
+        char tag = record.payload[arg_pos];
+        const char *value = record.payload + arg_pos + 1;
+        int written = 0;
+        if (tag == LOG_ARG_STRING)
+        {
+            uint16_t str_len;
+            memcpy(&str_len, value, 2);
+            spec[spec_len++] = 's';
+            spec[spec_len] = '\0';
+            char str[LOG_RECORD_SIZE];
+            memcpy(str, value + 2, str_len);
+            str[str_len] = '\0';
+            written = snprintf(out + len, out_len - len, spec, str);
+            arg_pos += 3 + str_len;
+        }
+        else
+        {
+            long long int_value;
+            double double_value;
+            memcpy(&int_value, value, 8);
+            memcpy(&double_value, value, 8);
+            if (tag == LOG_ARG_DOUBLE)
+            {
+                spec[spec_len++] = strchr("eEfgGaA", conversion) ? conversion : 'g';
+                spec[spec_len] = '\0';
+                written = snprintf(out + len, out_len - len, spec, double_value);
+            }
+            else
+            {
+                bool is_unsigned = (tag == LOG_ARG_UINT) || strchr("ouxX", conversion);
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = strchr("diouxXc", conversion) ? conversion : (is_unsigned ? 'u' : 'd');
+                spec[spec_len] = '\0';
+                if (conversion == 'c')
+                    written = snprintf(out + len, out_len - len, "%c", (char)int_value);
+                else if (is_unsigned)
+                    written = snprintf(out + len, out_len - len, spec, (unsigned long long)int_value);
+                else
+                    written = snprintf(out + len, out_len - len, spec, int_value);
+            }
+            arg_pos += 9;
+        }
+        if (written > 0)
+            len = std::min(len + written, out_len - 2);
+    }
+
+    // drop any newline in the format, then end line
+    while (len > 0 && out[len - 1] == '\n')
+        len--;
+    out[len++] = '\n';
+    return len;
+}
+
+/**************************************************
+ * formats all records waiting in every ring for one output, ERROR and
+ * WARN for stderr or the rest for stdout, and writes them in batches.
+ * records for the other output are left for the next pass over it
+ * Inputs:
+ *      - char *, batch buffer
+ *      - size_t, size of batch buffer
+ *      - int, fd to write to
+ *      - bool, true to write ERROR and WARN records, false for the rest
+ * Outputs:
+ *      - size_t, number of records written
+**************************************************/
+size_t Logger::drain(char *batch, size_t batch_len, int fd, bool to_stderr)
+{
+    size_t used = 0;
+    size_t count = 0;
+    int total_rings = num_rings.load(std::memory_order_acquire);
+
+    for (int r = 0; r < total_rings; r++)
+    {
+        LogRing *ring = rings[r];
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+
+        // report drops from this ring
+        uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0)
+        {
+            char line[128];
+            int line_len = snprintf(line, sizeof(line),
+                                    "WARN  logger dropped %llu messages\n",
+                                    (unsigned long long)dropped);
+            write_all(STDERR_FILENO, line, line_len);
+        }
+
+        // records are consumed in order, so stop at the first record for
+        // the other output
+        while (tail < head)
+        {
+            const LogRecord &record = ring->records[tail % LOG_RING_RECORDS];
+            if ((record.level <= LOG_WARN) != to_stderr)
+                break;
+            if (batch_len - used < 1024)
+            {
+                write_all(fd, batch, used);
+                used = 0;
+            }
+            used += format_record(record, batch + used, batch_len - used);
+            tail++;
+            count++;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+
+    if (used > 0)
+        write_all(fd, batch, used);
+    return count;
+}
+
+// body of background thread, drains rings until stopped
+void Logger::drain_loop()
+{
+    char *batch = new char[LOG_BATCH_SIZE];
+    while (true)
+    {
+        bool stopping = !running.load(std::memory_order_acquire);
+        size_t count = 0;
+
+        // alternate outputs until nothing is left in any ring
+        size_t pass;
+        do
+        {
+            pass = drain(batch, LOG_BATCH_SIZE, STDERR_FILENO, true);
+            pass += drain(batch, LOG_BATCH_SIZE, STDOUT_FILENO, false);
+            count += pass;
+        }
+        while (pass > 0);
+
+        if (stopping)
+            break;
+        if (count == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_IDLE_SLEEP_MS));
+    }
+    delete[] batch;
+}
+
+// starts the background thread that writes log records
+void Logger::start()
+{
+    if (running.exchange(true))
+        return;
+    drain_thread = std::thread(drain_loop);
+}
+
+// writes everything logged so far and stops the background thread
+void Logger::stop()
+{
+    if (!running.exchange(false))
+        return;
+    drain_thread.join();
+}
@@ -0,0 +1,121 @@
+// Header file for Logger class
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+
+// log levels, lower is more severe
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+// size of one binary log record, and number of records in each thread's ring
+#define LOG_RECORD_SIZE 256
+#define LOG_RING_RECORDS 1024
+
+// max number of threads that can log at once, rings of threads that
+// exited are reused
+#define LOG_MAX_THREADS 1024
+
+// argument type tags stored in records
+#define LOG_ARG_INT 1
+#define LOG_ARG_UINT 2
+#define LOG_ARG_DOUBLE 3
+#define LOG_ARG_STRING 4
+
+// one log message, arguments kept in binary until the background thread
+// formats them. fmt must be a string literal, only its pointer is stored
+struct LogRecord
+{
+    uint64_t timestamp_ns;
+    const char *fmt;
+    uint8_t level;
+    uint8_t num_args;
+    uint16_t used;
+    uint32_t reserved;
+    char payload[LOG_RECORD_SIZE - 24];
+};
+
+// single producer single consumer ring, one per logging thread. rings are
+// never freed, records a thread left behind are drained after it exits
+struct LogRing
+{
+    LogRecord records[LOG_RING_RECORDS];
+    std::atomic<uint64_t> head;     // records written by owning thread
+    std::atomic<uint64_t> tail;     // records consumed by background thread
+    std::atomic<uint64_t> dropped;  // records lost because ring was full
+};
+
+class Logger
+{
+    private:
+        static std::atomic<int> level;
+        static std::atomic<int> num_rings;
+        static LogRing *rings[LOG_MAX_THREADS];
+        static std::atomic<bool> running;
+
+        static LogRing *thread_ring();
+        static void drain_loop();
+        static size_t drain(char *batch, size_t batch_len, int fd, bool to_stderr);
+        static size_t format_record(const LogRecord &record, char *out, size_t out_len);
+    public:
+        static void start();
+        static void stop();
+        static void set_level(int new_level);
+        static int get_level();
+        static bool enabled(int msg_level);
+        static LogRecord *begin_record(int msg_level, const char *fmt);
+        static void commit_record();
+
+        static void add_arg(LogRecord *record, long long value);
+        static void add_arg(LogRecord *record, unsigned long long value);
+        static void add_arg(LogRecord *record, double value);
+        static void add_arg(LogRecord *record, const char *value);
+        static void add_arg(LogRecord *record, int value) { add_arg(record, (long long)value); }
+        static void add_arg(LogRecord *record, long value) { add_arg(record, (long long)value); }
+        static void add_arg(LogRecord *record, unsigned value) { add_arg(record, (unsigned long long)value); }
+        static void add_arg(LogRecord *record, unsigned long value) { add_arg(record, (unsigned long long)value); }
+        static void add_arg(LogRecord *record, char *value) { add_arg(record, (const char *)value); }
+};
+
+/**************************************************
+ * logs a printf style message without blocking. the message is stored as
+ * a binary record in the calling thread's ring and formatted later by the
+ * background thread. if the ring is full the message is dropped and
+ * counted. ERROR and WARN messages go to stderr, the rest to stdout
+ * Inputs:
+ *      - int, log level of message
+ *      - const char *, format string literal
+ *      - args for format, integers, doubles or strings
+ * Outputs:
+ *      - no return value
+**************************************************/
+template<typename... Args>
+void log_message(int msg_level, const char *fmt, Args... args)
+{
+    if (!Logger::enabled(msg_level))
+        return;
+    LogRecord *record = Logger::begin_record(msg_level, fmt);
+    if (record == NULL)
+        return;
+    int expand[] = { 0, (Logger::add_arg(record, args), 0)... };
+    (void)expand;
+    Logger::commit_record();
+}
+
+template<typename... Args>
+void log_error(const char *fmt, Args... args) { log_message(LOG_ERROR, fmt, args...); }
+
+template<typename... Args>
+void log_warn(const char *fmt, Args... args) { log_message(LOG_WARN, fmt, args...); }
+
+template<typename... Args>
+void log_info(const char *fmt, Args... args) { log_message(LOG_INFO, fmt, args...); }
+
+template<typename... Args>
+void log_debug(const char *fmt, Args... args) { log_message(LOG_DEBUG, fmt, args...); }
+
+#endif
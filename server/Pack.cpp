@@ -0,0 +1,163 @@
+#include "Pack.hpp"
+#include "Logger.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// constructor, no pack open
+Pack::Pack()
+{
+    fd = -1;
+    mapped = NULL;
+    mapped_len = 0;
+    header = NULL;
+    index = NULL;
+    names = NULL;
+}
+
+// unmaps pack
+Pack::~Pack()
+{
+    if (mapped != NULL)
+        munmap((void *)mapped, mapped_len);
+    if (fd >= 0)
+        close(fd);
+}
+
+// 64 bit FNV-1a hash of a file name
+uint64_t Pack::hash_name(const char *name, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**************************************************
+ * opens and maps a pack file built by ftpack, and checks that its header
+ * and every section fit inside the file. the fd is kept open so file
+ * contents can be sent with sendfile
+ * Inputs:
+ *      - const char *, path of pack file
+ * Outputs:
+ *      - bool, true if pack can be used, false if not, error is logged
+**************************************************/
+bool Pack::open_pack(const char *path)
+{
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat stat_buffer;
+    if (fd < 0 || fstat(fd, &stat_buffer) < 0)
+    {
+        log_error("unable to open pack \"%s\"", path);
+        return false;
+    }
+    mapped_len = stat_buffer.st_size;
+    if (mapped_len < sizeof(PackHeader))
+    {
+        log_error("\"%s\" is not a pack", path);
+        return false;
+    }
+
+    void *map = mmap(NULL, mapped_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        log_error("unable to map pack \"%s\"", path);
+        return false;
+    }
+    mapped = (const char *)map;
+    header = (const PackHeader *)mapped;
+
+    // validate header before trusting any offsets in it
+    uint64_t index_end = header->index_offset + header->count * sizeof(PackEntry);
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != PACK_VERSION || header->entry_size != sizeof(PackEntry) ||
+        header->file_len != mapped_len || header->index_offset % PACK_ALIGN != 0 ||
+        header->count > mapped_len / sizeof(PackEntry) || index_end > mapped_len ||
+        header->names_offset > mapped_len || header->names_len > mapped_len - header->names_offset ||
+        header->data_offset > mapped_len)
+    {
+        log_error("\"%s\" is not a valid pack", path);
+        munmap(map, mapped_len);
+        mapped = NULL;
+        header = NULL;
+        return false;
+    }
+    index = (const PackEntry *)(mapped + header->index_offset);
+    names = mapped + header->names_offset;
+
+    // lookups touch the index and names on every request, load them now.
+    // file contents are only read by sendfile through the fd
+    madvise((void *)mapped, header->data_offset, MADV_WILLNEED);
+
+    log_info("Serving %llu files from pack \"%s\"", (unsigned long long)header->count, path);
+    return true;
+}
+
+// true if a pack was opened successfully
+bool Pack::is_open()
+{
+    return header != NULL;
+}
+
+// fd of pack file, for sendfile
+int Pack::get_fd()
+{
+    return fd;
+}
+
+// number of files in pack
+uint64_t Pack::count()
+{
+    return header->count;
+}
+
+/**************************************************
+ * finds a file in the pack by binary search of the index on the hash of
+ * its name, then compares names of entries with that hash
+ * Inputs:
+ *      - const char *, name of file
+ * Outputs:
+ *      - const PackEntry *, entry of file, or NULL if not in pack
+**************************************************/
+const PackEntry *Pack::find(const char *name)
+{
+    size_t name_len = strlen(name);
+    uint64_t hash = hash_name(name, name_len);
+
+    // first entry with hash >= wanted hash
+    uint64_t low = 0;
+    uint64_t high = header->count;
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if (index[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (uint64_t i = low; i < header->count && index[i].hash == hash; i++)
+    {
+        const PackEntry &entry = index[i];
+        if (entry.name_len == name_len && (uint64_t)entry.name_offset + name_len <= header->names_len &&
+            memcmp(names + entry.name_offset, name, name_len) == 0)
+        {
+            if (entry.offset > mapped_len || entry.len > mapped_len - entry.offset)
+                return NULL;
+            return &entry;
+        }
+    }
+    return NULL;
+}
+
+// newline separated names of all files in pack, stores length in len
+const char *Pack::listing(size_t &len)
+{
+    len = header->names_len;
+    return names;
+}
@@ -0,0 +1,65 @@
+// Header file for Pack class
+#ifndef PACK_HPP
+#define PACK_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/* pack file layout, all integers in host byte order:
+*      header      one cache line, see PackHeader
+*      index       PackEntry for each file, sorted by name hash then name,
+*                  starting on a cache line
+*      names       every file name, sorted, separated by newlines. this is
+*                  exactly the listing sent for -l
+*      data        contents of each file, in name order
+* built by ftpack from the non-hidden regular files of a directory
+*/
+#define PACK_MAGIC "FTPACK01"
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+
+struct PackHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;    // sizeof(PackEntry) when pack was built
+    uint64_t count;         // number of files
+    uint64_t index_offset;
+    uint64_t names_offset;
+    uint64_t names_len;
+    uint64_t data_offset;
+    uint64_t file_len;      // total size of pack
+};
+
+// one file in the pack, two per cache line
+struct PackEntry
+{
+    uint64_t hash;          // hash_name of file name
+    uint64_t offset;        // of contents, from start of pack
+    uint64_t len;           // of contents
+    uint32_t name_offset;   // of name, from start of names
+    uint32_t name_len;
+};
+
+class Pack
+{
+    private:
+        int fd;
+        const char *mapped;
+        size_t mapped_len;
+        const PackHeader *header;
+        const PackEntry *index;
+        const char *names;
+    public:
+        Pack();
+        ~Pack();
+        static uint64_t hash_name(const char *name, size_t len);
+        bool open_pack(const char *path);
+        bool is_open();
+        int get_fd();
+        const PackEntry *find(const char *name);
+        const char *listing(size_t &len);
+        uint64_t count();
+};
+
+#endif
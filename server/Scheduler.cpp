@@ -0,0 +1,240 @@
+#include "Scheduler.hpp"
+#include <algorithm>
+#include <cstdio>
+
+using std::string;
+using std::vector;
+using std::map;
+
+// constructor, no rate limits until set by a control command
+Scheduler::Scheduler()
+{
+    init_bucket(global_bucket, 0);
+    host_rate = 0;
+    next_index[SCHED_PRIORITY] = 0;
+    next_index[SCHED_BULK] = 0;
+    selected = NULL;
+    bytes_sent = 0;
+}
+
+// sets up a full token bucket for the given rate. burst allows about
+// 100ms of data, but always at least one chunk so any chunk can be sent
+void Scheduler::init_bucket(TokenBucket &bucket, double rate)
+{
+    bucket.rate = rate;
+    bucket.burst = std::max(rate / 10, (double)SCHED_CHUNK);
+    bucket.tokens = bucket.burst;
+    bucket.last_refill = Clock::now();
+}
+
+// adds tokens for the time passed since last refill
+void Scheduler::refill(TokenBucket &bucket, Clock::time_point now)
+{
+    std::chrono::duration<double> elapsed = now - bucket.last_refill;
+    bucket.last_refill = now;
+    if (bucket.rate > 0)
+        bucket.tokens = std::min(bucket.burst, bucket.tokens + bucket.rate * elapsed.count());
+}
+
+// true if bucket is unlimited or has enough tokens for bytes
+bool Scheduler::has_tokens(TokenBucket &bucket, size_t bytes)
+{
+    return bucket.rate <= 0 || bucket.tokens >= bytes;
+}
+
+// time until bucket will have enough tokens for bytes
+double Scheduler::wait_seconds(TokenBucket &bucket, size_t bytes)
+{
+    if (has_tokens(bucket, bytes))
+        return 0;
+    return (bytes - bucket.tokens) / bucket.rate;
+}
+
+/**************************************************
+ * picks the next flow allowed to send. the priority class is always
+ * checked first. within a class, flows are served deficit round robin:
+ * each flow gets a quantum of credit when its turn comes around, and may
+ * keep sending while its credit covers its next chunk. flows whose host
+ * is out of tokens are skipped so they don't hold up other hosts.
+ * Inputs:
+ *      - Clock::time_point, current time for refilling host buckets
+ * Outputs:
+ *      - Flow *, flow to send next, or NULL if none can send
+**************************************************/
+Flow *Scheduler::select_next(Clock::time_point now)
+{
+    for (int c = SCHED_PRIORITY; c <= SCHED_BULK; c++)
+    {
+        vector<Flow *> &list = flows[c];
+        size_t n = list.size();
+        if (n == 0)
+            continue;
+
+        // a waiting flow gets one quantum each time its turn comes around,
+        // which always covers one chunk, so one pass over the list is
+        // enough to find a flow that can send if there is one
+        for (size_t visits = 0; visits <= 2 * n; visits++)
+        {
+            Flow *flow = list[next_index[c]];
+            if (flow->pending > 0)
+            {
+                TokenBucket &host = host_buckets[flow->host];
+                refill(host, now);
+                if (has_tokens(host, flow->pending) && flow->deficit >= (long)flow->pending)
+                    return flow;
+            }
+
+            // move on to next flow. flows that aren't waiting lose their
+            // credit, and credit is capped while a host is out of tokens
+            next_index[c] = (next_index[c] + 1) % n;
+            Flow *next = list[next_index[c]];
+            if (next->pending > 0)
+                next->deficit = std::min(next->deficit + SCHED_CHUNK, 2L * SCHED_CHUNK);
+            else
+                next->deficit = 0;
+        }
+    }
+    return NULL;
+}
+
+/**************************************************
+ * registers a new transfer with the scheduler. transfers small enough
+ * are put in the priority class
+ * Inputs:
+ *      - const char *, name of client host
+ *      - uint64_t, number of bytes that will be sent, 0 if unknown
+ * Outputs:
+ *      - Flow *, handle for the transfer, must be passed to finish_transfer
+**************************************************/
+Flow *Scheduler::start_transfer(const char *host, uint64_t total_len)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    Flow *flow = new Flow;
+    flow->host = host;
+    flow->sched_class = (total_len <= SCHED_SMALL_TRANSFER) ? SCHED_PRIORITY : SCHED_BULK;
+    flow->pending = 0;
+    flow->deficit = 0;
+    flows[flow->sched_class].push_back(flow);
+
+    map<string, TokenBucket>::iterator it = host_buckets.find(flow->host);
+    if (it == host_buckets.end())
+    {
+        init_bucket(host_buckets[flow->host], host_rate);
+        host_buckets[flow->host].users = 0;
+    }
+    host_buckets[flow->host].users++;
+    return flow;
+}
+
+// removes a finished transfer and frees it. per host bucket is removed
+// once its host has no active transfers
+void Scheduler::finish_transfer(Flow *flow)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    vector<Flow *> &list = flows[flow->sched_class];
+    size_t &index = next_index[flow->sched_class];
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        if (list[i] == flow)
+        {
+            list.erase(list.begin() + i);
+            if (i < index)
+                index--;
+            break;
+        }
+    }
+    if (index >= list.size())
+        index = 0;
+
+    if (--host_buckets[flow->host].users == 0)
+        host_buckets.erase(flow->host);
+    if (selected == flow)
+        selected = NULL;
+    delete flow;
+    ready.notify_all();
+}
+
+/**************************************************
+ * blocks until a flow may send the given number of bytes. waits for the
+ * flow's turn, and for both the global and host token buckets to hold
+ * enough tokens, then takes the tokens
+ * Inputs:
+ *      - Flow *, flow that wants to send
+ *      - size_t, number of bytes, at most SCHED_CHUNK
+ * Outputs:
+ *      - no return value, when returned the bytes may be sent
+**************************************************/
+void Scheduler::acquire(Flow *flow, size_t bytes)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    flow->pending = bytes;
+
+    while (true)
+    {
+        Clock::time_point now = Clock::now();
+        refill(global_bucket, now);
+        if (selected == NULL)
+            selected = select_next(now);
+
+        if (selected == flow && has_tokens(global_bucket, bytes))
+        {
+            TokenBucket &host = host_buckets[flow->host];
+            if (global_bucket.rate > 0)
+                global_bucket.tokens -= bytes;
+            if (host.rate > 0)
+                host.tokens -= bytes;
+            flow->deficit -= bytes;
+            flow->pending = 0;
+            bytes_sent += bytes;
+            selected = NULL;
+            ready.notify_all();
+            return;
+        }
+
+        // wait for our turn, or for the selected flow's tokens. check again
+        // at least every 10ms in case only host buckets are empty
+        double wait = 0.01;
+        if (selected != NULL)
+            wait = std::max(0.0005, std::min(wait, wait_seconds(global_bucket, selected->pending)));
+        ready.wait_for(guard, std::chrono::duration<double>(wait));
+    }
+}
+
+// sets the global rate limit in bytes per second, 0 for unlimited
+void Scheduler::set_global_rate(double rate)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    init_bucket(global_bucket, rate);
+    ready.notify_all();
+}
+
+// sets the rate limit for each client host in bytes per second, 0 for
+// unlimited. applies to active hosts immediately
+void Scheduler::set_host_rate(double rate)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    host_rate = rate;
+    for (map<string, TokenBucket>::iterator it = host_buckets.begin();
+         it != host_buckets.end(); ++it)
+    {
+        int users = it->second.users;
+        init_bucket(it->second, rate);
+        it->second.users = users;
+    }
+    ready.notify_all();
+}
+
+// returns a one line summary of limits and active transfers
+string Scheduler::status()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "rate=%.0f hostrate=%.0f priority=%zu bulk=%zu hosts=%zu sent=%llu",
+             global_bucket.rate, host_rate, flows[SCHED_PRIORITY].size(),
+             flows[SCHED_BULK].size(), host_buckets.size(),
+             (unsigned long long)bytes_sent);
+    return string(buffer);
+}
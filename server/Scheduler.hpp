@@ -0,0 +1,77 @@
+// Header file for Scheduler class
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+using std::string;
+using std::vector;
+using std::map;
+
+// largest piece of data sent at once, and the deficit round robin quantum
+#define SCHED_CHUNK (64 * 1024)
+
+// transfers of at most this many bytes go in the priority class
+#define SCHED_SMALL_TRANSFER (256 * 1024)
+
+// scheduling classes, priority class is always served first
+#define SCHED_PRIORITY 0
+#define SCHED_BULK 1
+
+// one active transfer
+struct Flow
+{
+    string host;
+    int sched_class;
+    size_t pending;     // bytes waiting to be sent, 0 if not waiting
+    long deficit;       // deficit round robin credit, in bytes
+};
+
+class Scheduler
+{
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        // token bucket rate limit. rate of 0 means unlimited
+        struct TokenBucket
+        {
+            double rate;        // bytes per second
+            double burst;       // max tokens
+            double tokens;
+            Clock::time_point last_refill;
+            int users;          // flows using this bucket, for per host buckets
+        };
+
+        std::mutex lock;
+        std::condition_variable ready;
+        TokenBucket global_bucket;
+        double host_rate;
+        map<string, TokenBucket> host_buckets;
+        vector<Flow *> flows[2];
+        size_t next_index[2];
+        Flow *selected;
+        uint64_t bytes_sent;
+
+        void init_bucket(TokenBucket &bucket, double rate);
+        void refill(TokenBucket &bucket, Clock::time_point now);
+        bool has_tokens(TokenBucket &bucket, size_t bytes);
+        double wait_seconds(TokenBucket &bucket, size_t bytes);
+        Flow *select_next(Clock::time_point now);
+    public:
+        Scheduler();
+        Flow *start_transfer(const char *host, uint64_t total_len);
+        void finish_transfer(Flow *flow);
+        void acquire(Flow *flow, size_t bytes);
+        void set_global_rate(double rate);
+        void set_host_rate(double rate);
+        string status();
+};
+
+#endif
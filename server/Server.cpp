@@ -1,5 +1,11 @@
 #include "Server.hpp"
 #include "Socketft.hpp"
+#include "Delta.hpp"
+#include "DirListing.hpp"
+#include "Archive.hpp"
+#include "Logger.hpp"
+#include "Tracer.hpp"
+#include "Affinity.hpp"
 #include <iostream>
 #include <string>
 #include <cstring>
@@ -13,10 +19,16 @@
 #include <vector>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <omp.h>
+#include <algorithm>
 
 using std::string;
-using std::cout;
-using std::endl;
 using std::vector;
 
 // constructor
@@ -26,6 +38,10 @@ Server::Server(char *p)
 {
     port = p;
     listen_socket = new Socketft(p);
+    unix_listen_socket = NULL;
+    unix_turn = false;
+    bulk_slots = 1;
+    bulk_running = 0;
 }
 
 // getter function for server port number
@@ -47,10 +63,69 @@ char* Server::get_port()
  bool Server::start_server()
 {
     if (listen_socket->start_listening())
+    {
+        // start reaping connections that miss their deadlines
+        wheel.start();
+
+        // continue access counts from previous run, and save them as they change
+        hot_files.load();
+        hot_files.start();
+
+        // one thread per core compresses archives for all clients
+        archive_pool.start(omp_get_num_procs());
         return true;
+    }
     return false;
 }
 
+// serves -l and -g from a pack file built by ftpack instead of the
+// current directory. returns false if the pack can't be used
+bool Server::open_pack(char *path)
+{
+    return pack.open_pack(path);
+}
+
+// encrypts command and data connections with TLS, using the certificate
+// and private key in a PEM file. returns false if they can't be loaded
+bool Server::enable_tls(char *pem_path)
+{
+    return tls.init(pem_path);
+}
+
+// also accepts clients on a unix domain socket at the given path. their
+// data connections are unix sockets too, see Socketft::open_connection
+bool Server::listen_unix(char *path)
+{
+    unix_listen_socket = new Socketft(path);
+    if (!unix_listen_socket->start_listening_unix())
+        return false;
+    log_info("Server now listening on unix socket %s...", path);
+    return true;
+}
+
+// sets up a new data connection like the command connection of the
+// current request: same request id, deadlines, and TLS if enabled
+void Server::prepare_data_socket(Socketft *data_socket)
+{
+    data_socket->set_request_id(Tracer::get_request());
+    data_socket->set_timer_wheel(&wheel);
+    data_socket->set_tls(tls.get_ctx());
+}
+
+// sets the number of threads handling clients. all but PRIORITY_WORKERS
+// of them may run bulk requests at once
+void Server::set_workers(int workers)
+{
+    bulk_slots = std::max(workers - PRIORITY_WORKERS, 1);
+}
+
+// loads the given number of most requested files into the page cache in
+// the background, using access counts saved by previous runs
+void Server::prewarm(size_t count)
+{
+    hot_files.prewarm(count);
+}
+
 
 
 /**************************************************
@@ -69,7 +144,13 @@ char* Server::get_port()
 **************************************************/
 void Server::recv_command(Socketft *client, char *command_array[3])
 {
+    ScopedSpan span("recv_command");
     char *command_string = client->recv_message();
+    if (command_string == NULL)
+    {
+        // connection closed, timed out, or message was malformed
+        return;
+    }
 
     // complete command received, parse it into individual args
     parse_command(command_string, command_array);
@@ -92,7 +173,31 @@ void Server::recv_command(Socketft *client, char *command_array[3])
 **************************************************/
 Socketft *Server::accept_client()
 {
-    return listen_socket->accept_connection();
+    // start new request first, so the reverse lookup in accept is traced
+    unsigned long long request_id = Tracer::new_request();
+
+    // wait for a client on either socket. when both have clients waiting,
+    // take turns, so neither can starve the other
+    Socketft *listener = listen_socket;
+    if (unix_listen_socket != NULL)
+    {
+        struct pollfd fds[2];
+        fds[0].fd = listen_socket->get_fd();
+        fds[1].fd = unix_listen_socket->get_fd();
+        fds[0].events = fds[1].events = POLLIN;
+        while (poll(fds, 2, -1) < 0 && errno == EINTR)
+            continue;
+        bool tcp_ready = (fds[0].revents & POLLIN) != 0;
+        bool unix_ready = (fds[1].revents & POLLIN) != 0;
+        if (unix_ready && (!tcp_ready || unix_turn))
+            listener = unix_listen_socket;
+        if (tcp_ready && unix_ready)
+            unix_turn = !unix_turn;
+    }
+
+    Socketft *client = listener->accept_connection();
+    client->set_request_id(request_id);
+    return client;
 }
 
 
@@ -107,13 +212,15 @@ Socketft *Server::accept_client()
  *      - no return value
  *      - command array will contain pointers to dynammically allocated strings
  *        for each arg
+ * uses strtok_r since clients are handled concurrently.
  * strtok portion based off example found here:
  * https://www.tutorialspoint.com/c_standard_library/c_function_strtok.htm
 **************************************************/
 void Server::parse_command(char *command, char *command_array[3])
 {
     const char delim[2] = " ";
-    char * arg = strtok(command, delim);
+    char *save_ptr;
+    char * arg = strtok_r(command, delim, &save_ptr);
     
     int num_args = 0;
     while (arg != NULL && num_args < 3)
@@ -121,7 +228,7 @@ void Server::parse_command(char *command, char *command_array[3])
         command_array[num_args] = new char[strlen(arg) + 1];
         strcpy(command_array[num_args], arg);
         num_args++;
-        arg = strtok(NULL, delim);
+        arg = strtok_r(NULL, delim, &save_ptr);
 
     }
 
@@ -142,9 +249,26 @@ void Server::parse_command(char *command, char *command_array[3])
 **************************************************/
 void Server::handle_client(Socketft *client)
 {
+    // continue the request started when connection was accepted
+    Tracer::set_request(client->get_request_id());
+    ScopedSpan span("handle_client");
+
+    // with -q, run on the CPU that received the connection until done
+    ScopedSteer steer(client->get_fd());
 
     // print name of client host
-    cout << "Connection from " << client->getHost() << endl;
+    log_info("Connection from %s", client->getHost());
+
+    // reap connection if client stalls at any point
+    client->set_timer_wheel(&wheel);
+
+    // handshake before command, so the command is encrypted too
+    client->set_tls(tls.get_ctx());
+    if (!client->start_tls(true))
+    {
+        client->close_socket();
+        return;
+    }
     
     /************************************************/
     // get command from client
@@ -160,14 +284,120 @@ void Server::handle_client(Socketft *client)
     if (command_array[0] == NULL)
     {
         // unable to receive command from socket
+        client->close_socket();
         return;
     }
 
+    // bulk requests wait for a slot without holding this worker, so
+    // workers stay free for small requests
+    uint64_t size = request_size(command_array);
+    bool bulk = (size > SCHED_SMALL_TRANSFER);
+    if (bulk && !admit_bulk(client, command_array, size))
+        return;
 
-    /************************************************/
-    // execute command
-    /************************************************/
+    run_command(client, command_array, size);
+    if (bulk)
+        run_parked();
+}
+
+/**************************************************
+ * estimates the bytes a request will send, so it can be classed as bulk
+ * before it runs. listings count the directory's entries, gets use the
+ * file's size. uploads, recursive listings and archives can't be sized up
+ * front and are always bulk
+ * Inputs:
+ *      - char * array, parsed command
+ * Outputs:
+ *      - uint64_t, estimated bytes, UINT64_MAX if not known
+**************************************************/
+uint64_t Server::request_size(char *command_array[3])
+{
+    const char *command = command_array[0];
+    char *file = command_array[1];
+
+    if (strcmp(command, "-l") == 0)
+    {
+        size_t listing_len = 0;
+        if (pack.is_open())
+            pack.listing(listing_len);
+        else
+            listing_len = DirListing::listing_size(".");
+        return listing_len;
+    }
+    if (strcmp(command, "-L") == 0)
+        return DirListing::listing_size(".");
+    if (strcmp(command, "-R") == 0 || strcmp(command, "-p") == 0 || strcmp(command, "-a") == 0)
+        return UINT64_MAX;
+    if ((strcmp(command, "-g") == 0 || strcmp(command, "-d") == 0) && file != NULL)
+    {
+        if (pack.is_open() && strcmp(command, "-g") == 0)
+        {
+            const PackEntry *entry = pack.find(file);
+            return (entry != NULL) ? entry->len : 0;
+        }
+        struct stat stat_buffer;
+        return (stat(file, &stat_buffer) == 0) ? stat_buffer.st_size : 0;
+    }
+
+    // control, descriptor passing and errors send little
+    return 0;
+}
 
+// takes a bulk slot for a request, or parks it to be run by the next
+// worker that finishes a bulk request. returns true if it may run now
+bool Server::admit_bulk(Socketft *client, char *command_array[3], uint64_t size)
+{
+    std::lock_guard<std::mutex> guard(admission_lock);
+    if (bulk_running < bulk_slots)
+    {
+        bulk_running++;
+        return true;
+    }
+
+    ParkedRequest request;
+    request.client = client;
+    for (int i = 0; i < 3; i++)
+        request.command_array[i] = command_array[i];
+    request.size = size;
+    parked.push_back(request);
+    log_debug("Bulk request from %s waits for a worker", client->getHost());
+    return false;
+}
+
+// runs parked bulk requests on the calling worker, which holds a bulk
+// slot, until none are left, then gives the slot back
+void Server::run_parked()
+{
+    while (true)
+    {
+        ParkedRequest request;
+        {
+            std::lock_guard<std::mutex> guard(admission_lock);
+            if (parked.empty())
+            {
+                bulk_running--;
+                return;
+            }
+            request = parked.front();
+            parked.pop_front();
+        }
+        Tracer::set_request(request.client->get_request_id());
+        run_command(request.client, request.command_array, request.size);
+    }
+}
+
+/**************************************************
+ * executes a received command, then frees it and closes the command
+ * socket
+ * Inputs:
+ *      - Socketft *, actively connected client command socket
+ *      - char * array, parsed command, deleted when done
+ *      - uint64_t, estimated bytes the request sends, see request_size
+ * Outputs:
+ *      - none
+**************************************************/
+void Server::run_command(Socketft *client, char *command_array[3], uint64_t size)
+{
     char * command = command_array[0];
 
     // received list directory command
@@ -175,11 +405,34 @@ void Server::handle_client(Socketft *client)
     {
         char *data_port = command_array[1];
 
+        if (data_port == NULL)
+        {
+            if (!client->send_message("ERROR: missing data port"))
+                log_error("unable to send status message to client command socket");
+        }
         // send OK status message on command socket
-        if (client->send_message("OK"))
+        else if (client->send_message("OK"))
             list_directory(data_port, client->getHost());   // handle -l command
         else
-            fprintf(stderr,"ERROR: unable to send status message to client command socket\n");
+            log_error("unable to send status message to client command socket");
+    }
+
+    // received metadata listing command, -R also lists subdirectories
+    else if (strcmp(command, "-L") == 0 || strcmp(command, "-R") == 0)
+    {
+        char *data_port = command_array[1];
+        bool recursive = (strcmp(command, "-R") == 0);
+
+        if (data_port == NULL)
+        {
+            if (!client->send_message("ERROR: missing data port"))
+                log_error("unable to send status message to client command socket");
+        }
+        // send OK status message on command socket
+        else if (client->send_message("OK"))
+            list_directory_stat(data_port, client->getHost(), recursive, size);
+        else
+            log_error("unable to send status message to client command socket");
     }
 
     // received get file command
@@ -188,11 +441,90 @@ void Server::handle_client(Socketft *client)
         char * filename = command_array[1];
         char * data_port = command_array[2];
 
+        if (filename == NULL || data_port == NULL)
+        {
+            if (!client->send_message("ERROR: missing filename"))
+                log_error("unable to send status message to client command socket");
+        }
+        else
+        {
+            log_info("File \"%s\" requested on port %s", filename, data_port);
 
-        printf("File \"%s\" requested on port %s\n", filename, data_port);
+            transfer_file(client, data_port, filename);
+        }
+    }
 
-        transfer_file(client, data_port, filename);
+    // received delta get command
+    else if (strcmp(command, "-d") == 0)
+    {
+        char * filename = command_array[1];
+        char * data_port = command_array[2];
 
+        if (filename == NULL || data_port == NULL)
+        {
+            if (!client->send_message("ERROR: missing filename"))
+                log_error("unable to send status message to client command socket");
+        }
+        else
+        {
+            log_info("Delta of \"%s\" requested on port %s", filename, data_port);
+
+            delta_transfer(client, data_port, filename);
+        }
+    }
+
+    // received put file command
+    else if (strcmp(command, "-p") == 0)
+    {
+        char * filename = command_array[1];
+        char * data_port = command_array[2];
+
+        if (filename == NULL || data_port == NULL)
+        {
+            if (!client->send_message("ERROR: missing filename"))
+                log_error("unable to send status message to client command socket");
+        }
+        else
+        {
+            log_info("Upload of \"%s\" requested on port %s", filename, data_port);
+
+            receive_file(client, data_port, filename);
+        }
+    }
+
+    // received get directory as archive command
+    else if (strcmp(command, "-a") == 0)
+    {
+        char * dirname = command_array[1];
+        char * data_port = command_array[2];
+
+        if (dirname == NULL || data_port == NULL)
+        {
+            if (!client->send_message("ERROR: missing filename"))
+                log_error("unable to send status message to client command socket");
+        }
+        else
+        {
+            log_info("Archive of \"%s\" requested on port %s", dirname, data_port);
+
+            transfer_archive(client, data_port, dirname);
+        }
+    }
+
+    // received get file command for a descriptor instead of data
+    else if (strcmp(command, "-f") == 0)
+    {
+        char * filename = command_array[1];
+
+        log_info("Descriptor of \"%s\" requested", filename);
+
+        pass_file(client, filename);
+    }
+
+    // received control command
+    else if (strcmp(command, "-c") == 0)
+    {
+        control(client, command_array[1], command_array[2]);
     }
 
     // delete contents of command_array, close command socket
@@ -349,7 +681,30 @@ vector<string> Server::get_dir_contents()
 **************************************************/
 void Server::list_directory(char *data_port, char *connected_host)
 {
-    printf("List directory requested on port %s\n", data_port);
+    log_info("List directory requested on port %s", data_port);
+
+    // listing of a pack is stored ready to send
+    if (pack.is_open())
+    {
+        size_t listing_len;
+        const char *listing = pack.listing(listing_len);
+        Socketft data_socket(data_port, connected_host);
+        prepare_data_socket(&data_socket);
+        if (data_socket.open_connection())
+        {
+            log_info("Sending pack listing to %s:%s", connected_host, data_port);
+            Flow *flow = scheduler.start_transfer(connected_host, listing_len);
+            data_socket.set_scheduler(&scheduler, flow);
+            if (!data_socket.send_bytes(listing, listing_len))
+            {
+                log_error("unable to send directory contents to %s:%s",
+                        connected_host, data_port);
+            }
+            scheduler.finish_transfer(flow);
+            data_socket.close_socket();
+        }
+        return;
+    }
 
     // get all non-hidden filenames
     vector<string> dir_contents = get_dir_contents();
@@ -368,24 +723,67 @@ void Server::list_directory(char *data_port, char *connected_host)
     
     // open connection to client on data port, send content string
     Socketft data_socket(data_port, connected_host);
+    prepare_data_socket(&data_socket);
 
     // check connection was successful
     if (data_socket.open_connection())
     {
         // send contents of directory, checking for error
-        printf("Sending directory contents to %s:%s\n", connected_host, data_port);
-        fflush(stdout);
-        if (!data_socket.send_message(content_string.c_str()))
+        log_info("Sending directory contents to %s:%s", connected_host, data_port);
+        Flow *flow = scheduler.start_transfer(connected_host, content_string.size());
+        data_socket.set_scheduler(&scheduler, flow);
+        if (!data_socket.send_bytes(content_string.c_str(), content_string.size()))
         {
-            fprintf(stderr, "ERROR: unable to send directory contents to %s:%s\n", 
+            log_error("unable to send directory contents to %s:%s", 
                     connected_host, data_port);
-            fflush(stderr);
         }
+        scheduler.finish_transfer(flow);
         data_socket.close_socket();
     }
 }
 
 
+/**************************************************
+ * Function to handle a metadata listing command. opens data transfer
+ * connection and streams name, size, mtime, mode and inode of each
+ * non-hidden entry in pages, see DirListing class for format
+ * Inputs:
+ *      - char *, data port to connect to
+ *      - char *, connected host's name
+ *      - bool, true to include contents of subdirectories
+ *      - uint64_t, size of a non-recursive listing, see request_size
+ * Outputs:
+ *      - no returns, when complete, command has been fulfilled
+ *        or error message is printed
+**************************************************/
+void Server::list_directory_stat(char *data_port, char *connected_host, bool recursive,
+                                 uint64_t listing_len)
+{
+    log_info("%s listing requested on port %s", recursive ? "Recursive" : "Metadata", data_port);
+
+    // open connection to client on data port
+    Socketft data_socket(data_port, connected_host);
+    prepare_data_socket(&data_socket);
+    if (!data_socket.open_connection())
+        return;
+
+    log_info("Sending directory listing to %s:%s", connected_host, data_port);
+
+    // size of recursive listings isn't known up front, they are bulk
+    Flow *flow = scheduler.start_transfer(connected_host, recursive ? UINT64_MAX : listing_len);
+    data_socket.set_scheduler(&scheduler, flow);
+
+    DirListing listing(&data_socket, recursive);
+    if (!listing.send_listing("."))
+    {
+        log_error("unable to send directory listing to %s:%s",
+                connected_host, data_port);
+    }
+    scheduler.finish_transfer(flow);
+    data_socket.close_socket();
+}
+
+
 /**************************************************
  * checks if a given filename exists in current directory. gets list of 
  * all existing files, compares with given name. doesn't allow for 
@@ -397,6 +795,8 @@ void Server::list_directory(char *data_port, char *connected_host)
 **************************************************/
 bool Server::valid_filename(char *filename)
 {
+    ScopedSpan span("dir_scan");
+
     // get names of all files in directory
     vector<string> dir_contents = get_dir_contents();
     
@@ -442,6 +842,7 @@ bool Server::is_directory(char *filename)
 **************************************************/
 char *Server::get_file_contents(char *filename)
 {
+    ScopedSpan span("read_file");
     char *contents = NULL;
     int file_len;
     
@@ -455,6 +856,9 @@ char *Server::get_file_contents(char *filename)
         fseek(fp, 0, SEEK_SET);
         if (file_len != -1)
         {
+            // whole file is read in order, start reading ahead now
+            HotFiles::prepare_read(fileno(fp), file_len);
+
             contents = new char[file_len + 1];
 
             //fgets(contents, file_len + 1, fp);
@@ -468,32 +872,26 @@ char *Server::get_file_contents(char *filename)
 
 
 /**************************************************
- * function to handle file transfer command. makes sure requested file
- * exists and is not a directory. gets contents of file, opens data connection
- * to client, and sends file.
+ * makes sure a requested file exists in current directory and is not a
+ * directory. sends error message on command socket if not.
  * Inputs:
- *      - int &, actively connected socket fd, used for command communication
- *      - char *, name of connected host
- *      - char *, port number for data transfer connection
+ *      - Socketft *, client command socket
  *      - char *, name of requested file
  * Outputs:
- *      - bool, true if file transferred successfully, false if not
+ *      - bool, true if file can be sent, false if error was sent to client
 **************************************************/
-bool Server::transfer_file(Socketft *client, char *data_port, char *file)
+bool Server::check_requested_file(Socketft *client, char *file)
 {
-
     char *host = client->getHost();
     // check if file exists in current directory
     if (!valid_filename(file))
     {
         // file not found, send error message on command socket
-        printf("File not found. Sending error message to %s:%s\n", host, port);
-        fflush(stdout);
+        log_info("File not found. Sending error message to %s:%s", host, port);
 
         // check for success sending
         if (!client->send_message("ERROR: file not found"))
-            fprintf(stderr,"ERROR: unable to send status message to client command socket\n");
-            fflush(stderr);
+            log_error("unable to send status message to client command socket");
         // file not transferred
         return false;
     }
@@ -501,31 +899,56 @@ bool Server::transfer_file(Socketft *client, char *data_port, char *file)
     else if (is_directory(file))
     {
         // file is a directory, send error message on command socket
-        printf("\"%s\" is a directory. Sending error message to %s:%s\n", file, host, port);
-        fflush(stdout);
+        log_info("\"%s\" is a directory. Sending error message to %s:%s", file, host, port);
 
         // check for success sending
         string err_msg = "ERROR: \"" + string(file) + "\" is a directory";
         if (!client->send_message(err_msg.c_str()))
-            fprintf(stderr,"ERROR: unable to send status message to client command socket\n");
-            fflush(stderr);
+            log_error("unable to send status message to client command socket");
 
         // file not transferred
         return false;
     }
 
+    return true;
+}
+
+
+/**************************************************
+ * function to handle file transfer command. makes sure requested file
+ * exists and is not a directory. gets contents of file, opens data connection
+ * to client, and sends file.
+ * Inputs:
+ *      - int &, actively connected socket fd, used for command communication
+ *      - char *, name of connected host
+ *      - char *, port number for data transfer connection
+ *      - char *, name of requested file
+ * Outputs:
+ *      - bool, true if file transferred successfully, false if not
+**************************************************/
+bool Server::transfer_file(Socketft *client, char *data_port, char *file)
+{
+    if (pack.is_open())
+        return transfer_packed(client, data_port, file);
+
+    char *host = client->getHost();
+
+    // make sure file can be sent, error message already sent if not
+    if (!check_requested_file(client, file))
+        return false;
+    hot_files.record(file);
+
     // call function to get pointer to string containing file contents
     char *contents = get_file_contents(file);
 
     // check for error
     if (contents == NULL)
     {
-        printf("Unable to read file. Sending error message to %s:%s\n", host, port);
+        log_info("Unable to read file. Sending error message to %s:%s", host, port);
         
         // check for success sending
         if (!client->send_message("ERROR: unable to read file"))
-            fprintf(stderr,"ERROR: unable to send status message to client command socket\n");
-            fflush(stderr);
+            log_error("unable to send status message to client command socket");
         // file not transferred
         return false;
     }
@@ -534,8 +957,7 @@ bool Server::transfer_file(Socketft *client, char *data_port, char *file)
     if (!client->send_message("OK"))
     {
         // OK message failed
-        fprintf(stderr,"ERROR: unable to send status message to client command socket\n");
-        fflush(stderr);
+        log_error("unable to send status message to client command socket");
 
         // file not transferred
         delete contents;
@@ -544,16 +966,26 @@ bool Server::transfer_file(Socketft *client, char *data_port, char *file)
 
     // open connection to client on data port, send content string
     Socketft data_socket(data_port, host);
+    prepare_data_socket(&data_socket);
 
     // check connection was successful
     if (data_socket.open_connection())
     {
-        printf("Sending \"%s\" to %s:%s\n", file, host, data_port);
-        fflush(stdout);
-        if (!data_socket.send_message(contents))
+        log_info("Sending \"%s\" to %s:%s", file, host, data_port);
+
+        // send in chunks paced by the transfer scheduler
+        size_t contents_len = strlen(contents);
+        Flow *flow = scheduler.start_transfer(host, contents_len);
+        data_socket.set_scheduler(&scheduler, flow);
+        bool sent;
         {
-            fprintf(stderr, "ERROR: unable to transfer file to %s:%s\n", host, data_port);
-            fflush(stderr);
+            ScopedSpan send_span("send_data");
+            sent = data_socket.send_bytes(contents, contents_len);
+        }
+        scheduler.finish_transfer(flow);
+        if (!sent)
+        {
+            log_error("unable to transfer file to %s:%s", host, data_port);
             delete contents;
             data_socket.close_socket();
             return false;
@@ -568,3 +1000,500 @@ bool Server::transfer_file(Socketft *client, char *data_port, char *file)
     delete contents;
     return false; 
 }
+
+
+/**************************************************
+ * function to handle file transfer command when serving a pack. the file
+ * is looked up in the pack's index, then sent from the pack file with
+ * sendfile, so no files are opened or stat'ed for the request
+ * Inputs:
+ *      - Socketft *, actively connected client command socket
+ *      - char *, port number for data transfer connection
+ *      - char *, name of requested file
+ * Outputs:
+ *      - bool, true if file transferred successfully, false if not
+**************************************************/
+bool Server::transfer_packed(Socketft *client, char *data_port, char *file)
+{
+    char *host = client->getHost();
+
+    const PackEntry *entry;
+    {
+        ScopedSpan span("pack_lookup");
+        entry = pack.find(file);
+    }
+    if (entry == NULL)
+    {
+        log_info("File not found. Sending error message to %s:%s", host, port);
+        if (!client->send_message("ERROR: file not found"))
+            log_error("unable to send status message to client command socket");
+        return false;
+    }
+    hot_files.record(file);
+
+    if (!client->send_message("OK"))
+    {
+        log_error("unable to send status message to client command socket");
+        return false;
+    }
+
+    Socketft data_socket(data_port, host);
+    prepare_data_socket(&data_socket);
+    if (!data_socket.open_connection())
+        return false;
+
+    log_info("Sending \"%s\" from pack to %s:%s", file, host, data_port);
+
+    // same framing as send_bytes, with contents going straight from page cache
+    char len_buf[32];
+    snprintf(len_buf, sizeof(len_buf), "%llu$", (unsigned long long)entry->len);
+    Flow *flow = scheduler.start_transfer(host, entry->len);
+    data_socket.set_scheduler(&scheduler, flow);
+    bool sent;
+    {
+        ScopedSpan send_span("send_data");
+        sent = data_socket.send_all(len_buf, strlen(len_buf)) &&
+               data_socket.send_file(pack.get_fd(), entry->offset, entry->len);
+    }
+    scheduler.finish_transfer(flow);
+    if (!sent)
+        log_error("unable to transfer file to %s:%s", host, data_port);
+    data_socket.close_socket();
+    return sent;
+}
+
+
+/**************************************************
+ * function to handle a get directory command. makes sure requested name
+ * is a directory in the current directory, then streams the whole tree
+ * under it over the data connection as one archive, compressed in
+ * parallel. see Archive class for format
+ * Inputs:
+ *      - Socketft *, actively connected client command socket
+ *      - char *, port number for data transfer connection
+ *      - char *, name of requested directory
+ * Outputs:
+ *      - bool, true if archive sent, false if not
+**************************************************/
+bool Server::transfer_archive(Socketft *client, char *data_port, char *dir)
+{
+    char *host = client->getHost();
+
+    const char *error = NULL;
+    if (!valid_filename(dir))
+        error = "ERROR: file not found";
+    else if (!is_directory(dir))
+        error = "ERROR: not a directory";
+    if (error != NULL)
+    {
+        log_info("Unable to archive \"%s\". Sending error message to %s:%s", dir, host, port);
+        if (!client->send_message(error))
+            log_error("unable to send status message to client command socket");
+        return false;
+    }
+
+    if (!client->send_message("OK"))
+    {
+        log_error("unable to send status message to client command socket");
+        return false;
+    }
+
+    Socketft data_socket(data_port, host);
+    prepare_data_socket(&data_socket);
+    if (!data_socket.open_connection())
+        return false;
+
+    log_info("Sending archive of \"%s\" to %s:%s", dir, host, data_port);
+
+    // size isn't known up front, archives are always bulk
+    Flow *flow = scheduler.start_transfer(host, UINT64_MAX);
+    data_socket.set_scheduler(&scheduler, flow);
+    Archive archive(&data_socket, &archive_pool);
+    bool sent = archive.send_archive(dir);
+    scheduler.finish_transfer(flow);
+    if (sent)
+        log_info("Sent %llu files (%llu bytes) of \"%s\" to %s:%s",
+                 (unsigned long long)archive.get_total_files(),
+                 (unsigned long long)archive.get_total_bytes(), dir, host, data_port);
+    else
+        log_error("unable to send archive to %s:%s", host, data_port);
+    data_socket.close_socket();
+    return sent;
+}
+
+
+/**************************************************
+ * function to handle a get file command from a client on this host,
+ * answered with an open read only descriptor instead of the data. the
+ * reply "OK <offset> <length>" on the command socket carries the
+ * descriptor, and the client reads the file from it directly. when
+ * serving a pack, the descriptor is for the pack, and offset and length
+ * give where the file is in it. only possible on unix socket connections
+ * Inputs:
+ *      - Socketft *, actively connected client command socket
+ *      - char *, name of requested file
+ * Outputs:
+ *      - bool, true if descriptor was sent, false if not
+**************************************************/
+bool Server::pass_file(Socketft *client, char *file)
+{
+    char *host = client->getHost();
+    const char *error = NULL;
+    int file_fd = -1;
+    bool opened = false;
+    unsigned long long offset = 0;
+    unsigned long long len = 0;
+
+    if (!client->is_unix())
+        error = "ERROR: descriptors can only be passed on unix socket connections";
+    else if (file == NULL)
+        error = "ERROR: missing file name";
+    else if (pack.is_open())
+    {
+        const PackEntry *entry = pack.find(file);
+        if (entry == NULL)
+            error = "ERROR: file not found";
+        else
+        {
+            file_fd = pack.get_fd();
+            offset = entry->offset;
+            len = entry->len;
+        }
+    }
+    else
+    {
+        // error message already sent if file can't be sent
+        if (!check_requested_file(client, file))
+            return false;
+        file_fd = open(file, O_RDONLY | O_CLOEXEC);
+        opened = (file_fd >= 0);
+        struct stat stat_buffer;
+        if (!opened || fstat(file_fd, &stat_buffer) < 0)
+            error = "ERROR: unable to read file";
+        else
+            len = stat_buffer.st_size;
+    }
+
+    if (error != NULL)
+    {
+        log_info("Unable to pass \"%s\". Sending error message to %s", file, host);
+        if (!client->send_message(error))
+            log_error("unable to send status message to client command socket");
+        if (opened)
+            close(file_fd);
+        return false;
+    }
+    hot_files.record(file);
+
+    char reply[64];
+    snprintf(reply, sizeof(reply), "OK %llu %llu", offset, len);
+    log_info("Passing descriptor of \"%s\" (%llu bytes) to %s", file, len, host);
+    bool sent = client->send_fd(file_fd, reply);
+    if (!sent)
+        log_error("unable to pass descriptor to client command socket");
+    if (opened)
+        close(file_fd);
+    return sent;
+}
+
+
+/**************************************************
+ * function to handle delta get command. after the file is checked and OK
+ * is sent, the client sends the block signature of its existing copy on
+ * the command socket. the file is scanned for blocks the client already
+ * has, and only literal bytes and block references are sent on the data
+ * connection. see Delta class for formats
+ * Inputs:
+ *      - Socketft *, actively connected client command socket
+ *      - char *, port number for data transfer connection
+ *      - char *, name of requested file
+ * Outputs:
+ *      - bool, true if delta transferred successfully, false if not
+**************************************************/
+bool Server::delta_transfer(Socketft *client, char *data_port, char *file)
+{
+    char *host = client->getHost();
+
+    // make sure file can be sent, error message already sent if not
+    if (!check_requested_file(client, file))
+        return false;
+    hot_files.record(file);
+
+    // send OK status message on command socket
+    if (!client->send_message("OK"))
+    {
+        log_error("unable to send status message to client command socket");
+        return false;
+    }
+
+    // receive signature of client's copy
+    size_t sig_len = 0;
+    char *signature = client->recv_bytes(sig_len, DELTA_MAX_SIGNATURE);
+    if (signature == NULL)
+    {
+        log_error("unable to receive signature from %s:%s", host, port);
+        return false;
+    }
+
+    Delta delta;
+    bool valid = delta.parse_signature(signature, sig_len);
+    delete[] signature;
+    if (!valid)
+    {
+        log_error("invalid signature received from %s:%s", host, port);
+        return false;
+    }
+
+    bool computed;
+    {
+        ScopedSpan span("delta_scan");
+        computed = delta.compute(file);
+    }
+    if (!computed)
+    {
+        log_error("unable to read \"%s\"", file);
+        return false;
+    }
+
+    // open connection to client on data port, send delta
+    Socketft data_socket(data_port, host);
+    prepare_data_socket(&data_socket);
+    if (!data_socket.open_connection())
+        return false;
+
+    log_info("Sending delta of \"%s\" to %s:%s (%llu literal bytes)", file, host, data_port,
+           (unsigned long long)delta.literal_bytes());
+
+    Flow *flow = scheduler.start_transfer(host, delta.literal_bytes());
+    data_socket.set_scheduler(&scheduler, flow);
+    bool sent;
+    {
+        ScopedSpan span("send_data");
+        sent = delta.send(&data_socket);
+    }
+    scheduler.finish_transfer(flow);
+    if (!sent)
+    {
+        log_error("unable to transfer delta to %s:%s", host, data_port);
+    }
+    data_socket.close_socket();
+    return sent;
+}
+
+
+/**************************************************
+ * function to handle a control command, which changes server settings
+ * at runtime. only accepted from clients on the same host. settings:
+ *      rate <bytes per second>     global transfer rate limit, 0 for none
+ *      hostrate <bytes per second> rate limit for each client host
+ *      loglevel <0-3>              0 errors only, 1 warnings, 2 info, 3 debug
+ *      tracesample <n>             trace one request in n, 0 for none
+ *      tracedump                   recent trace spans as Chrome trace JSON
+ *      hotfiles                    most requested files and their scores
+ *      status                      current limits, active transfers, and
+ *                                  connections reaped for missing deadlines
+ * replies on command socket with "OK: <status>", the trace JSON, or an
+ * error message
+ * Inputs:
+ *      - Socketft *, actively connected client command socket
+ *      - char *, name of setting, may be NULL
+ *      - char *, new value of setting, may be NULL
+ * Outputs:
+ *      - no return value
+**************************************************/
+void Server::control(Socketft *client, char *setting, char *value)
+{
+    string reply;
+    if (!client->is_loopback())
+        reply = "ERROR: control commands are only accepted from the server's host";
+    else if (setting == NULL)
+        reply = "ERROR: missing control setting";
+    else if (strcmp(setting, "status") == 0)
+        reply = "OK: " + scheduler.status() + " reaped=" + std::to_string(wheel.get_reaped()) +
+                " " + Affinity::status();
+    else if (strcmp(setting, "tracedump") == 0)
+        reply = Tracer::dump_json(TRACE_DUMP_MAX);
+    else if (strcmp(setting, "hotfiles") == 0)
+        reply = "OK: " + hot_files.status(HOT_STATUS_FILES);
+    else if (value == NULL || !isdigit((unsigned char)value[0]))
+        reply = "ERROR: missing or invalid control value";
+    else if (strcmp(setting, "rate") == 0)
+    {
+        scheduler.set_global_rate(atof(value));
+        reply = "OK: " + scheduler.status();
+    }
+    else if (strcmp(setting, "hostrate") == 0)
+    {
+        scheduler.set_host_rate(atof(value));
+        reply = "OK: " + scheduler.status();
+    }
+    else if (strcmp(setting, "tracesample") == 0)
+    {
+        Tracer::set_sample_rate(atoi(value));
+        reply = "OK: tracesample=" + std::to_string(Tracer::get_sample_rate());
+    }
+    else if (strcmp(setting, "loglevel") == 0)
+    {
+        Logger::set_level(atoi(value));
+        reply = "OK: loglevel=" + std::to_string(Logger::get_level());
+    }
+    else
+        reply = "ERROR: unknown control setting";
+
+    // trace dump can be large, don't log it
+    bool is_dump = (reply[0] == '{');
+    log_info("Control command from %s: %s", client->getHost(),
+             is_dump ? "trace dumped" : reply.c_str());
+
+    // size_t length prefix, a dump can be larger than send_message allows
+    if (!client->send_bytes(reply.data(), reply.size()))
+    {
+        log_error("unable to send status message to client command socket");
+    }
+}
+
+
+/**************************************************
+ * checks that a name given for an upload is a plain, non-hidden file name
+ * in the current directory (no paths) and isn't an existing directory
+ * Inputs:
+ *      - char *, name to check
+ * Outputs:
+ *      - bool, true if name can be used, false if not
+**************************************************/
+bool Server::valid_upload_name(char *filename)
+{
+    if (filename == NULL || filename[0] == '\0' || filename[0] == '.')
+        return false;
+    if (strchr(filename, '/') != NULL || strlen(filename) > 200)
+        return false;
+
+    struct stat stat_buffer;
+    if (stat(filename, &stat_buffer) == 0 && !S_ISREG(stat_buffer.st_mode))
+        return false;
+    return true;
+}
+
+
+/**************************************************
+ * function to handle put file command. after the name is checked and OK
+ * is sent, the client sends the size of the file on the command socket.
+ * the data is written to a hidden temp file, preallocated to that size,
+ * by splicing from the data socket, then renamed over the target name so
+ * readers never see a partial file. a second upload of a name already
+ * being uploaded is refused. final status is sent on the command socket
+ * Inputs:
+ *      - Socketft *, actively connected client command socket
+ *      - char *, port number for data transfer connection
+ *      - char *, name to store file as
+ * Outputs:
+ *      - bool, true if file received and stored, false if not
+**************************************************/
+bool Server::receive_file(Socketft *client, char *data_port, char *file)
+{
+    char *host = client->getHost();
+
+    string error;
+    if (!valid_upload_name(file))
+        error = "ERROR: invalid file name";
+    else
+    {
+        // claim name so concurrent uploads to it are refused
+        std::lock_guard<std::mutex> guard(uploads_lock);
+        if (!uploads.insert(file).second)
+            error = "ERROR: upload of \"" + string(file) + "\" already in progress";
+    }
+    if (!error.empty())
+    {
+        log_info("Refusing upload of \"%s\". Sending error message to %s:%s", file, host, port);
+        if (!client->send_message(error.c_str()))
+        {
+            log_error("unable to send status message to client command socket");
+        }
+        return false;
+    }
+
+    bool stored = false;
+    char *size_message = NULL;
+    unsigned long long file_len = 0;
+    int temp_fd = -1;
+    string temp_name = "." + string(file) + ".XXXXXX";
+    vector<char> temp_buffer(temp_name.begin(), temp_name.end());
+    temp_buffer.push_back('\0');
+
+    // send OK, then get advertised size of file
+    if (!client->send_message("OK"))
+        error = "unable to send status message to client command socket";
+    else
+    {
+        size_t message_len;
+        size_message = client->recv_bytes(message_len, UPLOAD_SIZE_MESSAGE);
+        char *end = NULL;
+        errno = 0;
+        if (size_message != NULL && isdigit((unsigned char)size_message[0]))
+            file_len = strtoull(size_message, &end, 10);
+        if (end == NULL || *end != '\0' || errno != 0)
+            error = "unable to receive file size";
+    }
+
+    if (error.empty())
+    {
+
+        // create temp file and reserve space for whole file up front
+        temp_fd = mkstemp(temp_buffer.data());
+        if (temp_fd < 0)
+            error = "unable to create temp file";
+        else if (file_len > 0 && fallocate(temp_fd, 0, 0, file_len) < 0 && errno != EOPNOTSUPP)
+            error = (errno == ENOSPC) ? "not enough space for file" : "unable to allocate file";
+        else
+            fchmod(temp_fd, 0644);
+    }
+
+    if (error.empty())
+    {
+        Socketft data_socket(data_port, host);
+        prepare_data_socket(&data_socket);
+        if (!data_socket.open_connection())
+            error = "unable to open data connection";
+        else
+        {
+            log_info("Receiving \"%s\" (%llu bytes) from %s:%s", file, file_len, host, data_port);
+            ScopedSpan span("recv_file");
+            if (!data_socket.recv_file(temp_fd, file_len))
+                error = "connection closed before entire file was received";
+            data_socket.close_socket();
+        }
+    }
+
+    // replace target with completed file in one step
+    if (error.empty() && rename(temp_buffer.data(), file) < 0)
+        error = "unable to store file";
+    else if (error.empty())
+        stored = true;
+
+    if (temp_fd >= 0)
+    {
+        close(temp_fd);
+        if (!stored)
+            unlink(temp_buffer.data());
+    }
+    delete[] size_message;
+
+    {
+        std::lock_guard<std::mutex> guard(uploads_lock);
+        uploads.erase(file);
+    }
+
+    // send final status on command socket
+    string status = stored ? "OK" : "ERROR: " + error;
+    if (!stored)
+    {
+        log_error("upload of \"%s\" from %s failed: %s", file, host, error.c_str());
+    }
+    else
+    {
+        log_info("Stored \"%s\" from %s:%s", file, host, data_port);
+    }
+    client->send_message(status.c_str());
+    return stored;
+}
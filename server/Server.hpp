@@ -4,30 +4,88 @@
 
 #include <string>
 #include <vector>
+#include <set>
+#include <deque>
+#include <mutex>
 #include "Socketft.hpp"
+#include "Scheduler.hpp"
+#include "TimerWheel.hpp"
+#include "HotFiles.hpp"
+#include "Archive.hpp"
+#include "Pack.hpp"
+#include "Tls.hpp"
+
+// longest upload size message accepted, a decimal file size
+#define UPLOAD_SIZE_MESSAGE 32
+
+// workers that never run bulk requests, so small requests are served
+// while bulk transfers keep the others busy
+#define PRIORITY_WORKERS 2
+
+// a bulk request waiting for a worker, see admit_bulk
+struct ParkedRequest
+{
+    Socketft *client;
+    char *command_array[3];
+    uint64_t size;
+};
 
 using std::vector;
 using std::string;
+using std::set;
 class Server
 {
     private:
         char *port;
         Socketft *listen_socket;
+        Socketft *unix_listen_socket;   // NULL unless listening on a unix socket
+        bool unix_turn;             // next accept is from unix socket if both are ready
+        Scheduler scheduler;
+        TimerWheel wheel;           // deadlines of all client connections
+        HotFiles hot_files;         // access counts of requested files
+        ArchivePool archive_pool;   // compresses pieces of archives being sent
+        Pack pack;                  // serves -l and -g instead of directory when open
+        Tls tls;                    // encrypts all connections when enabled
+        set<string> uploads;        // names with an upload in progress
+        std::mutex uploads_lock;
+        int bulk_slots;             // bulk requests that may run at once
+        int bulk_running;
+        std::deque<ParkedRequest> parked;   // bulk requests waiting for a slot
+        std::mutex admission_lock;
     public:
         Server(char* port);
         char* get_port();
         bool start_server(); //
+        void prewarm(size_t);
+        void set_workers(int);
+        bool open_pack(char *);
+        bool enable_tls(char *);
+        bool listen_unix(char *);
+        void prepare_data_socket(Socketft *);
         void handle_client(Socketft*);
+        uint64_t request_size(char * [3]);
+        bool admit_bulk(Socketft *, char * [3], uint64_t);
+        void run_parked();
+        void run_command(Socketft *, char * [3], uint64_t);
         Socketft *accept_client();
         void recv_command(Socketft *, char * [3]);
         void parse_command(char *, char * [3]);
         void list_directory(char *, char *);
+        void list_directory_stat(char *, char *, bool, uint64_t);
         // bool send_message(const char *, int&);
         vector<string> get_dir_contents();
         // int open_data_connection(char *, char*); //
         bool valid_filename(char *);
         bool is_directory(char *);
         bool transfer_file(Socketft *, char *, char *);
+        bool transfer_packed(Socketft *, char *, char *);
+        bool transfer_archive(Socketft *, char *, char *);
+        bool pass_file(Socketft *, char *);
+        bool check_requested_file(Socketft *, char *);
+        bool delta_transfer(Socketft *, char *, char *);
+        void control(Socketft *, char *, char *);
+        bool valid_upload_name(char *);
+        bool receive_file(Socketft *, char *, char *);
         char *get_file_contents(char*);
 };
 
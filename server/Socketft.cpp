@@ -11,17 +11,59 @@
 #include <vector>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <cerrno>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
 #include "Socketft.hpp"
+#include "Scheduler.hpp"
+#include "Logger.hpp"
+#include "Tracer.hpp"
+#include "TimerWheel.hpp"
+#include "Affinity.hpp"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// deadline for moving len bytes that started at start_ms: a grace period
+// for slow starts, then time to move the data at the minimum rate
+static unsigned long long transfer_deadline(unsigned long long start_ms, unsigned long long len)
+{
+    return start_ms + DEADLINE_TRANSFER_GRACE_MS + len * 1000 / MIN_TRANSFER_RATE;
+}
 
 Socketft::Socketft(char* p)
 {
     port = p;
+    fd = -1;
+    scheduler = nullptr;
+    flow = nullptr;
+    request_id = 0;
+    wheel = nullptr;
+    timer = nullptr;
+    tls_ctx = nullptr;
+    ssl = nullptr;
+    unix_socket = false;
 }
 
+// a host starting with "/" is the path of a unix socket, and the port is
+// appended to it to get the path to connect to
 Socketft::Socketft(char* p, char* h)
 {
     port = p;
     host = h;
+    fd = -1;
+    scheduler = nullptr;
+    flow = nullptr;
+    request_id = 0;
+    wheel = nullptr;
+    timer = nullptr;
+    tls_ctx = nullptr;
+    ssl = nullptr;
+    unix_socket = (h != nullptr && h[0] == '/');
 }
 
 Socketft::Socketft(char* h, int f)
@@ -29,17 +71,228 @@ Socketft::Socketft(char* h, int f)
     port = nullptr;
     host = h;
     fd = f;
+    scheduler = nullptr;
+    flow = nullptr;
+    request_id = 0;
+    wheel = nullptr;
+    timer = nullptr;
+    tls_ctx = nullptr;
+    ssl = nullptr;
+    unix_socket = false;
 }
 
 char *Socketft::getHost()
 {
     return host;
 }
+int Socketft::get_fd()
+{
+    return fd;
+}
+
+// tells if this is a unix domain socket. the host of a unix connection
+// is the path of the server's socket
+bool Socketft::is_unix()
+{
+    return unix_socket;
+}
 char *Socketft::getPort()
 {
     return port;
 }
 
+// attaches a transfer scheduler, after which send_all sends in chunks
+// and waits for the scheduler before each one
+void Socketft::set_scheduler(Scheduler *s, Flow *f)
+{
+    scheduler = s;
+    flow = f;
+}
+
+// setter and getter for id of request this connection belongs to
+void Socketft::set_request_id(unsigned long long id)
+{
+    request_id = id;
+}
+unsigned long long Socketft::get_request_id()
+{
+    return request_id;
+}
+
+// attaches a timer wheel, after which blocking operations on this socket
+// have deadlines and the connection is shut down if one passes
+void Socketft::set_timer_wheel(TimerWheel *w)
+{
+    wheel = w;
+}
+
+// sets deadline of the current operation to ms from now. the timer is
+// created on first use, since data sockets have no fd until connected.
+// does nothing if no wheel is attached
+void Socketft::arm_deadline(unsigned ms, const char *phase)
+{
+    arm_deadline_at(TimerWheel::now_ms() + ms, phase);
+}
+
+// same as arm_deadline, with deadline given in TimerWheel::now_ms() time
+void Socketft::arm_deadline_at(unsigned long long deadline_ms, const char *phase)
+{
+    if (wheel == nullptr || fd < 0)
+        return;
+    if (timer == nullptr)
+        timer = wheel->add(fd, request_id);
+    wheel->arm_at(timer, deadline_ms, phase);
+}
+
+// cancels deadline of the current operation
+void Socketft::disarm_deadline()
+{
+    if (timer != nullptr)
+        wheel->disarm(timer);
+}
+
+// tells if the connection was shut down because a deadline passed
+bool Socketft::timed_out()
+{
+    return timer != nullptr && wheel->expired(timer);
+}
+
+// makes this connection use TLS, as the server side. open_connection
+// does the handshake itself, accepted sockets need start_tls
+void Socketft::set_tls(ssl_ctx_st *ctx)
+{
+    tls_ctx = ctx;
+}
+
+/**************************************************
+ * does the server side TLS handshake on a connected socket, within the
+ * handshake deadline. afterwards all sends and receives are encrypted,
+ * by the kernel if OpenSSL could enable kernel TLS for the session
+ * Inputs:
+ *      - bool, true to send the client resumption tickets. should be false
+ *        when the client may never read from the connection, since a client
+ *        that closes with tickets unread resets the connection, losing data
+ * Outputs:
+ *      - bool, true if handshake completed, false if not, error is logged
+**************************************************/
+bool Socketft::start_tls(bool send_tickets)
+{
+    // unix sockets never leave this host, they aren't encrypted
+    if (tls_ctx == nullptr || unix_socket)
+        return true;
+
+    ScopedSpan span("tls_handshake");
+    ssl = SSL_new(tls_ctx);
+    if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1)
+    {
+        log_error("unable to create TLS session");
+        return false;
+    }
+    if (!send_tickets)
+        SSL_set_num_tickets(ssl, 0);
+
+    arm_deadline(DEADLINE_HANDSHAKE_MS, "tls handshake");
+    int result = SSL_accept(ssl);
+    disarm_deadline();
+    if (result != 1)
+    {
+        char error[256];
+        ERR_error_string_n(ERR_get_error(), error, sizeof(error));
+        log_error("TLS handshake with %s failed: %s", host, error);
+        return false;
+    }
+
+    log_debug("TLS handshake with %s: %s %s, %s, kernel TLS send %s receive %s", host,
+              SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+              SSL_session_reused(ssl) ? "resumed" : "full",
+              BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "on" : "off",
+              BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "on" : "off");
+    return true;
+}
+
+// sends up to len bytes, through TLS if enabled. same returns as send()
+ssize_t Socketft::raw_send(const char *data, size_t len)
+{
+    if (ssl == nullptr)
+        return send(fd, data, len, MSG_NOSIGNAL);
+
+    size_t written = 0;
+    if (SSL_write_ex(ssl, data, len, &written) == 1)
+        return written;
+    return -1;
+}
+
+// receives up to len bytes, through TLS if enabled. same returns as recv()
+ssize_t Socketft::raw_recv(char *buffer, size_t len)
+{
+    if (ssl == nullptr)
+        return recv(fd, buffer, len, 0);
+
+    size_t bytes_read = 0;
+    if (SSL_read_ex(ssl, buffer, len, &bytes_read) == 1)
+        return bytes_read;
+    return (SSL_get_error(ssl, 0) == SSL_ERROR_ZERO_RETURN) ? 0 : -1;
+}
+
+/* sends up to len bytes of a file from offset and advances offset. uses
+* sendfile, which also works on kernel TLS sockets. if TLS is done by
+* OpenSSL in user space, the file has to be read and encrypted here
+*/
+ssize_t Socketft::send_file_chunk(int file_fd, off_t *offset, size_t len)
+{
+    if (ssl == nullptr)
+        return sendfile(fd, file_fd, offset, len);
+
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    {
+        ossl_ssize_t sent = SSL_sendfile(ssl, file_fd, *offset, len, 0);
+        if (sent > 0)
+            *offset += sent;
+        return sent;
+    }
+
+    char *buffer = Affinity::buffer();
+    if (buffer == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t bytes_read = pread(file_fd, buffer, std::min(len, (size_t)AFFINITY_BUFFER_SIZE), *offset);
+    if (bytes_read <= 0)
+        return -1;
+    ssize_t sent = raw_send(buffer, bytes_read);
+    if (sent > 0)
+        *offset += sent;
+    return sent;
+}
+
+// tells if the connected peer is on this host (127.0.0.0/8, ::1, or a
+// unix socket)
+bool Socketft::is_loopback()
+{
+    if (unix_socket)
+        return true;
+
+    struct sockaddr_storage peer_addr;
+    socklen_t addr_size = sizeof(peer_addr);
+    if (getpeername(fd, (struct sockaddr *)&peer_addr, &addr_size) < 0)
+        return false;
+
+    if (peer_addr.ss_family == AF_INET)
+    {
+        struct sockaddr_in *addr = (struct sockaddr_in *)&peer_addr;
+        return (ntohl(addr->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (peer_addr.ss_family == AF_INET6)
+    {
+        struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&peer_addr;
+        if (IN6_IS_ADDR_LOOPBACK(&addr->sin6_addr))
+            return true;
+        return IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr) && addr->sin6_addr.s6_addr[12] == 127;
+    }
+    return false;
+}
+
 bool Socketft::start_listening()
 {
     int status;
@@ -57,16 +310,14 @@ bool Socketft::start_listening()
     // check for success
     if (status < 0)
     {
-        fprintf(stderr, "ERROR: Unable to find address info for port %s\n", port);
-        fflush(stderr);
+        log_error("Unable to find address info for port %s", port);
         return false;
     }
 
     fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
     if (fd < 0)
     {
-        fprintf(stderr, "ERROR: unable to open socket\n");
-        fflush(stderr);
+        log_error("unable to open socket");
         return false;
     }
 
@@ -74,8 +325,7 @@ bool Socketft::start_listening()
     status = bind(fd, servinfo->ai_addr, servinfo->ai_addrlen);
     if (status < 0)
     {
-        fprintf(stderr, "ERROR: Unable to bind on port %s\n", port);
-        fflush(stderr);
+        log_error("Unable to bind on port %s", port);
         return false;
     }
 
@@ -83,8 +333,7 @@ bool Socketft::start_listening()
     status = listen(fd, 5);
     if (status < 0)
     {
-        fprintf(stderr, "ERROR: Unable to listen port %s\n", port);
-        fflush(stderr);
+        log_error("Unable to listen port %s", port);
         return false;
     }
 
@@ -93,7 +342,78 @@ bool Socketft::start_listening()
     return true;
 }
 
+/* listens on a unix domain socket, with the path given as port. a stale
+* socket left at the path by an earlier run is replaced. accepted
+* connections are unix connections whose host is this path
+*/
+bool Socketft::start_listening_unix()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(port) >= sizeof(addr.sun_path) || port[0] != '/')
+    {
+        log_error("unix socket path must be absolute and under %zu characters",
+                  sizeof(addr.sun_path));
+        return false;
+    }
+    strcpy(addr.sun_path, port);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        log_error("unable to open unix socket");
+        return false;
+    }
+
+    // only remove something at the path if it is a socket
+    struct stat stat_buffer;
+    if (lstat(port, &stat_buffer) == 0 && S_ISSOCK(stat_buffer.st_mode))
+        unlink(port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        log_error("Unable to bind unix socket %s", port);
+        return false;
+    }
+    if (listen(fd, 5) < 0)
+    {
+        log_error("Unable to listen on unix socket %s", port);
+        return false;
+    }
+    unix_socket = true;
+    return true;
+}
+
 bool Socketft::open_connection(){
+    ScopedSpan span("connect_back");
+
+    // client of a unix connection listens at <server socket path>.<port>
+    if (unix_socket)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        int path_len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%s", host, port);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || path_len >= (int)sizeof(addr.sun_path))
+        {
+            log_error("unable to create data socket");
+            close_socket();
+            return false;
+        }
+
+        arm_deadline(DEADLINE_CONNECT_MS, "connect");
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            log_error("unable to start data transfer connection on %s", addr.sun_path);
+            close_socket();
+            return false;
+        }
+        disarm_deadline();
+        return true;
+    }
+
     // create structs for address info
     struct addrinfo hints, *res;
 
@@ -109,24 +429,33 @@ bool Socketft::open_connection(){
     fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     if (fd < 0)
     {    
-        fprintf(stderr, "ERROR: unable to create data socket\n");
-        fflush(stderr);
+        log_error("unable to create data socket");
         freeaddrinfo(res);
         return false;
     }
 
-    // connect socket to server
+    // connect socket to server, giving up if client doesn't answer in time
+    arm_deadline(DEADLINE_CONNECT_MS, "connect");
     if (connect(fd, res->ai_addr, res->ai_addrlen) < 0)
     {
-        fprintf(stderr, "ERROR: unable to start data transfer connection with host %s:%s\n", 
+        log_error("unable to start data transfer connection with host %s:%s", 
                 host, port);
-        fflush(stderr);
         freeaddrinfo(res);
+        close_socket();
         return false;
     }
+    disarm_deadline();
 
     freeaddrinfo(res);
 
+    // server is the TLS server on data connections too, whichever side
+    // connects. client resumes from its command connection, no new tickets
+    if (!start_tls(false))
+    {
+        close_socket();
+        return false;
+    }
+
     // successfully connected to client's data transfer socket
     return true;
 }
@@ -140,10 +469,23 @@ Socketft *Socketft::accept_connection()
     // accept client connection
     int newfd = accept(fd, (struct sockaddr *)&client_addr, &addr_size);
 
+    // unix clients have no address, their host is the socket's path
+    if (unix_socket)
+    {
+        char *path = new char[strlen(port) + 1];
+        strcpy(path, port);
+        Socketft *newConn = new Socketft(path, newfd);
+        newConn->unix_socket = true;
+        return newConn;
+    }
+
     // extract host name of connected client
     char connected_host[1024];
-    getnameinfo((struct sockaddr *)&client_addr, addr_size, connected_host, 
-                sizeof(connected_host), NULL, 0, 0);
+    {
+        ScopedSpan span("reverse_dns");
+        getnameinfo((struct sockaddr *)&client_addr, addr_size, connected_host, 
+                    sizeof(connected_host), NULL, 0, 0);
+    }
 
     char *host_name = new char[strlen(connected_host) + 1];
     strcpy(host_name, connected_host);
@@ -157,12 +499,23 @@ char *Socketft::recv_message()
     char read_buff[1025];
     memset(read_buff, '\0', sizeof(read_buff));
 
-    // read from new socket
-    int bytes_read = recv(fd, read_buff, 1024, 0);
-    if (bytes_read < 0)
+    // read from new socket. client must start sending soon after connecting,
+    // and finish the message soon after starting it
+    arm_deadline(DEADLINE_HANDSHAKE_MS, "handshake");
+    int bytes_read = raw_recv(read_buff, 1024);
+    if (bytes_read <= 0)
+    {
+        disarm_deadline();
         return nullptr;
+    }
+    arm_deadline(DEADLINE_COMMAND_MS, "command");
         
     char *delim_char = strstr(read_buff, "$");
+    if (delim_char == NULL)
+    {
+        disarm_deadline();
+        return nullptr;
+    }
     *delim_char = '\0';
 
     //convert size string to int. size of actual user message
@@ -182,11 +535,12 @@ char *Socketft::recv_message()
     while (total_read < message_size)
     {
         memset(read_buff, '\0', sizeof(read_buff));
-        bytes_read = recv(fd, read_buff, 1024, 0);
+        bytes_read = raw_recv(read_buff, 1024);
 
         // check for error or closed connection
         if (bytes_read <= 0)
         {
+            disarm_deadline();
             delete(message);
             return nullptr;
         }
@@ -196,6 +550,7 @@ char *Socketft::recv_message()
         strcat(message, read_buff);
     }
 
+    disarm_deadline();
     return message;
 }
 
@@ -219,19 +574,30 @@ bool Socketft::send_message(const char *message)
     strcat(complete_message, "$");
     strcat(complete_message, message);
 
-    // attempt to send message to socket, check for error
-    int total_sent = send(fd, complete_message, total_len, 0);
+    // attempt to send message to socket, check for error. peer must read
+    // it before command deadline
+    arm_deadline(DEADLINE_COMMAND_MS, "reply");
+    int total_sent = raw_send(complete_message, total_len);
     if (total_sent <= 0)
+    {
+        disarm_deadline();
         return false;
+    }
 
-    // make sure entire message was sent
+    // make sure entire message was sent. the peer usually acks within a
+    // round trip, so check often at first, then back off
+    ScopedSpan span("send_wait");
     int check_send = -19;
-    do 
+    useconds_t wait_us = SEND_WAIT_MIN_US;
+    ioctl(fd, TIOCOUTQ, &check_send);
+    while (check_send > 0 && !timed_out())
     {
-        ioctl(fd, TIOCOUTQ, &check_send); 
+        usleep(wait_us);
+        wait_us = std::min(wait_us * 2, (useconds_t)SEND_WAIT_MAX_US);
+        ioctl(fd, TIOCOUTQ, &check_send);
     }
-    while (check_send > 0);
-    if (check_send < 0) 
+    disarm_deadline();
+    if (check_send != 0) 
         return false;
 
     // message sent successfully
@@ -240,8 +606,329 @@ bool Socketft::send_message(const char *message)
 }
 
  void Socketft::close_socket(){
+     // tell peer no more data is coming, without waiting for its reply
+     if (ssl != nullptr)
+     {
+         if (!timed_out())
+             SSL_shutdown(ssl);
+         SSL_free(ssl);
+         ssl = nullptr;
+     }
+
+     // timer must be off the wheel before fd can be reused
+     if (timer != nullptr)
+     {
+         wheel->remove(timer);
+         timer = nullptr;
+     }
      close(fd);
 }
 
 
- 
\ No newline at end of file
+ 
+/* sends a message in send_message format, with an open file descriptor
+* attached (SCM_RIGHTS), so the peer gets its own descriptor for the same
+* open file. only works on unix sockets. the caller keeps its descriptor
+*/
+bool Socketft::send_fd(int file_fd, const char *message)
+{
+    std::string framed = std::to_string(strlen(message)) + "$" + message;
+
+    struct iovec iov;
+    iov.iov_base = (void *)framed.data();
+    iov.iov_len = framed.size();
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &file_fd, sizeof(int));
+
+    arm_deadline(DEADLINE_COMMAND_MS, "reply");
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    disarm_deadline();
+
+    // rest of message, without the descriptor, if it didn't all fit
+    if (sent > 0 && (size_t)sent < framed.size())
+        return send_all(framed.data() + sent, framed.size() - sent);
+    return sent > 0;
+}
+
+/* binary safe version of send_message. same <message_length>$<message_text>
+* format, but the length is given by the caller instead of strlen, so the
+* message may contain null bytes and be larger than 2 GB
+*/
+bool Socketft::send_bytes(const char *data, size_t len)
+{
+    char len_buf[32];
+    memset(len_buf, '\0', sizeof(len_buf));
+    snprintf(len_buf, sizeof(len_buf), "%zu$", len);
+
+    // send length prefix, then message body
+    if (!send_all(len_buf, strlen(len_buf)))
+        return false;
+    return send_all(data, len);
+}
+
+/* binary safe version of recv_message. reads the length prefix one byte at
+* a time so nothing past the end of this message is consumed from the socket,
+* then reads exactly that many bytes. stores message length in len.
+* messages longer than max_len are refused before anything is allocated.
+* returned buffer is null terminated, dynamically allocated, and needs to be
+* deleted elsewhere. returns nullptr on error
+*/
+char *Socketft::recv_bytes(size_t &len, size_t max_len)
+{
+    char len_buf[32];
+    memset(len_buf, '\0', sizeof(len_buf));
+
+    // read length digits up to the "$" delimiter
+    unsigned long long start_ms = TimerWheel::now_ms();
+    arm_deadline_at(start_ms + DEADLINE_COMMAND_MS, "command");
+    size_t i = 0;
+    while (true)
+    {
+        if (i == sizeof(len_buf) - 1 || !recv_all(len_buf + i, 1) ||
+            (len_buf[i] != '$' && !isdigit((unsigned char)len_buf[i])))
+        {
+            disarm_deadline();
+            return nullptr;
+        }
+        if (len_buf[i] == '$')
+            break;
+        i++;
+    }
+    len_buf[i] = '\0';
+    errno = 0;
+    unsigned long long advertised = strtoull(len_buf, NULL, 10);
+    if (i == 0 || errno != 0 || advertised > max_len)
+    {
+        disarm_deadline();
+        return nullptr;
+    }
+    len = advertised;
+
+    // message body must arrive at the minimum transfer rate
+    arm_deadline_at(transfer_deadline(start_ms, len), "recv");
+    char *message = new char[len + 1];
+    message[len] = '\0';
+    bool received = recv_all(message, len);
+    disarm_deadline();
+    if (!received)
+    {
+        delete[] message;
+        return nullptr;
+    }
+    return message;
+}
+
+// sends len bytes without any framing, looping until all have been
+// handed to the kernel. if a scheduler is attached, data is sent in
+// chunks and each chunk waits for its turn. returns false if the
+// connection fails
+bool Socketft::send_all(const char *data, size_t len)
+{
+    unsigned long long deadline = transfer_deadline(TimerWheel::now_ms(), len);
+    arm_deadline_at(deadline, "send");
+
+    size_t total_sent = 0;
+    bool ok = true;
+    while (ok && total_sent < len)
+    {
+        size_t chunk_end = len;
+        if (scheduler != nullptr)
+        {
+            chunk_end = total_sent + std::min(len - total_sent, (size_t)SCHED_CHUNK);
+
+            // time spent waiting for the scheduler isn't the peer's fault
+            unsigned long long wait_start = TimerWheel::now_ms();
+            scheduler->acquire(flow, chunk_end - total_sent);
+            unsigned long long waited = TimerWheel::now_ms() - wait_start;
+            if (waited > 0)
+            {
+                deadline += waited;
+                arm_deadline_at(deadline, "send");
+            }
+        }
+
+        while (total_sent < chunk_end)
+        {
+            ssize_t sent = raw_send(data + total_sent, chunk_end - total_sent);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+            {
+                ok = false;
+                break;
+            }
+            total_sent += sent;
+        }
+    }
+    disarm_deadline();
+    return ok;
+}
+
+// receives exactly len bytes without any framing. returns false if the
+// connection is closed or fails first
+bool Socketft::recv_all(char *buffer, size_t len)
+{
+    size_t total_read = 0;
+    while (total_read < len)
+    {
+        ssize_t bytes_read = raw_recv(buffer + total_read, len - total_read);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            return false;
+        total_read += bytes_read;
+    }
+    return true;
+}
+
+/* sends len bytes of an open file starting at offset, without any
+* framing. data goes from the page cache to the socket with sendfile(),
+* in scheduler chunks if a scheduler is attached. returns false if the
+* connection fails or the file is shorter than expected
+*/
+bool Socketft::send_file(int file_fd, unsigned long long offset, unsigned long long len)
+{
+    unsigned long long deadline = transfer_deadline(TimerWheel::now_ms(), len);
+    arm_deadline_at(deadline, "send");
+
+    off_t file_offset = offset;
+    unsigned long long end = offset + len;
+    bool ok = true;
+    while (ok && (unsigned long long)file_offset < end)
+    {
+        unsigned long long chunk_end = end;
+        if (scheduler != nullptr)
+        {
+            chunk_end = file_offset + std::min(end - file_offset, (unsigned long long)SCHED_CHUNK);
+
+            // time spent waiting for the scheduler isn't the peer's fault
+            unsigned long long wait_start = TimerWheel::now_ms();
+            scheduler->acquire(flow, chunk_end - file_offset);
+            unsigned long long waited = TimerWheel::now_ms() - wait_start;
+            if (waited > 0)
+            {
+                deadline += waited;
+                arm_deadline_at(deadline, "send");
+            }
+        }
+
+        while ((unsigned long long)file_offset < chunk_end)
+        {
+            ssize_t sent = send_file_chunk(file_fd, &file_offset, chunk_end - file_offset);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+            {
+                ok = false;
+                break;
+            }
+        }
+    }
+    disarm_deadline();
+    return ok;
+}
+
+// size requested for the pipe used by recv_file
+#define SPLICE_PIPE_SIZE (1 << 20)
+
+/* receives exactly len bytes from the socket into an open file, starting
+* at offset 0. data is moved with splice() from the socket into a pipe and
+* from the pipe into the file, so it is never copied into user space.
+* falls back to recv/write if splice isn't supported for this socket or
+* file. returns false if the connection closes early or a write fails
+*/
+bool Socketft::recv_file(int file_fd, unsigned long long len)
+{
+    arm_deadline_at(transfer_deadline(TimerWheel::now_ms(), len), "recv");
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0)
+    {
+        disarm_deadline();
+        return false;
+    }
+    int pipe_size = fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (pipe_size <= 0)
+        pipe_size = 64 * 1024;
+
+    loff_t offset = 0;
+    // a kernel TLS socket splices decrypted data. with user space TLS,
+    // data must go through OpenSSL
+    bool use_splice = (ssl == nullptr) ||
+                      (BIO_get_ktls_recv(SSL_get_rbio(ssl)) && SSL_pending(ssl) == 0);
+    bool ok = true;
+    char *buffer = NULL;
+
+    while (ok && (unsigned long long)offset < len)
+    {
+        size_t want = std::min(len - offset, (unsigned long long)pipe_size);
+
+        if (use_splice)
+        {
+            ssize_t in_pipe = splice(fd, NULL, pipe_fds[1], NULL, want,
+                                     SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in_pipe < 0 && errno == EINTR)
+                continue;
+            if (in_pipe < 0 && errno == EINVAL && offset == 0)
+            {
+                use_splice = false;
+                continue;
+            }
+            if (in_pipe <= 0)
+            {
+                ok = false;
+                break;
+            }
+
+            // move everything now in the pipe into the file
+            while (in_pipe > 0)
+            {
+                ssize_t written = splice(pipe_fds[0], NULL, file_fd, &offset, in_pipe,
+                                         SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                {
+                    ok = false;
+                    break;
+                }
+                in_pipe -= written;
+            }
+            continue;
+        }
+
+        // copy through user space buffer
+        if (buffer == NULL && (buffer = Affinity::buffer()) == NULL)
+        {
+            ok = false;
+            break;
+        }
+        ssize_t bytes_read = raw_recv(buffer, std::min(want, (size_t)AFFINITY_BUFFER_SIZE));
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0 || pwrite(file_fd, buffer, bytes_read, offset) != bytes_read)
+        {
+            ok = false;
+            break;
+        }
+        offset += bytes_read;
+    }
+
+    disarm_deadline();
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return ok;
+}
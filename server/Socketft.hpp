@@ -2,23 +2,71 @@
 #ifndef SOCKETFT_HPP
 #define SOCKETFT_HPP
 
+#include <cstddef>
+#include <sys/types.h>
+
+// sleep between checks that a sent message has been acked, doubling from
+// min to max
+#define SEND_WAIT_MIN_US 50
+#define SEND_WAIT_MAX_US 10000
+
+class Scheduler;
+struct Flow;
+class TimerWheel;
+struct Timer;
+struct ssl_st;
+struct ssl_ctx_st;
+
 class Socketft
 {
     private:
         char* port;
         char* host;
         int fd;
+        Scheduler *scheduler;   // paces send_all when set
+        Flow *flow;
+        unsigned long long request_id;  // for tracing
+        TimerWheel *wheel;      // enforces deadlines when set
+        Timer *timer;           // created on first deadline
+        ssl_ctx_st *tls_ctx;    // TLS is used when set
+        ssl_st *ssl;            // TLS session, after start_tls
+        bool unix_socket;       // AF_UNIX instead of TCP
+
+        ssize_t raw_send(const char *data, size_t len);
+        ssize_t raw_recv(char *buffer, size_t len);
+        ssize_t send_file_chunk(int file_fd, off_t *offset, size_t len);
     public:
         Socketft(char *port); // for listening socket
         Socketft(char * port, char *host); // for remote connection socket
         Socketft(char* host, int fd); // for newly accepted socket
+        int get_fd();
+        bool is_unix();
         char *getHost();
         char *getPort();
+        void set_scheduler(Scheduler *scheduler, Flow *flow);
+        bool is_loopback();
+        void set_request_id(unsigned long long id);
+        unsigned long long get_request_id();
+        void set_timer_wheel(TimerWheel *wheel);
+        void arm_deadline(unsigned ms, const char *phase);
+        void arm_deadline_at(unsigned long long deadline_ms, const char *phase);
+        void disarm_deadline();
+        bool timed_out();
+        void set_tls(ssl_ctx_st *ctx);
+        bool start_tls(bool send_tickets);
         bool start_listening();
+        bool start_listening_unix();
         bool open_connection();
         Socketft *accept_connection();
         char *recv_message();
         bool send_message(const char* message);
+        bool send_fd(int file_fd, const char *message);
+        bool send_bytes(const char *data, size_t len);
+        char *recv_bytes(size_t &len, size_t max_len);
+        bool send_all(const char *data, size_t len);
+        bool recv_all(char *buffer, size_t len);
+        bool recv_file(int file_fd, unsigned long long len);
+        bool send_file(int file_fd, unsigned long long offset, unsigned long long len);
         void close_socket();
 
         
@@ -0,0 +1,233 @@
+#include "TimerWheel.hpp"
+#include "Logger.hpp"
+#include <chrono>
+#include <cstring>
+#include <sys/socket.h>
+
+// constructor, all slots empty
+TimerWheel::TimerWheel()
+{
+    memset(slots, 0, sizeof(slots));
+    start_ms = now_ms();
+    current_tick = 0;
+    running = false;
+    reaped = 0;
+}
+
+// stops reaper thread if still running
+TimerWheel::~TimerWheel()
+{
+    stop();
+}
+
+// milliseconds from a monotonic clock
+uint64_t TimerWheel::now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**************************************************
+ * puts an armed timer in the slot for its expiry tick. timers expiring
+ * within one turn of level 0 go in level 0, later ones in the first level
+ * whose slots are wide enough, and are moved down as the wheel turns.
+ * lock must be held
+ * Inputs:
+ *      - Timer *, timer with expires set
+ * Outputs:
+ *      - no return value
+**************************************************/
+void TimerWheel::insert(Timer *timer)
+{
+    uint64_t expires = timer->expires;
+    int level = 0;
+
+    if (expires < current_tick)
+        expires = current_tick;     // already due, expire on next tick
+    uint64_t delta = expires - current_tick;
+
+    // find level with slots wide enough for delta
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_SLOT_BITS * (level + 1))))
+        level++;
+
+    // clamp deadlines past the top level
+    uint64_t max_delta = (1ULL << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) - 1;
+    if (delta > max_delta)
+        expires = current_tick + max_delta;
+
+    int index = (expires >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1);
+    Timer **slot = &slots[level][index];
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL)
+        (*slot)->prev = timer;
+    *slot = timer;
+}
+
+// removes a timer from its slot's list in O(1). lock must be held
+void TimerWheel::unlink(Timer *timer)
+{
+    if (timer->slot == NULL)
+        return;
+    if (timer->prev != NULL)
+        timer->prev->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+    timer->slot = NULL;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+// moves every timer in one slot of a higher level down to the levels
+// below, now that the wheel has reached that slot. lock must be held
+void TimerWheel::cascade(int level, int index)
+{
+    Timer *timer = slots[level][index];
+    slots[level][index] = NULL;
+    while (timer != NULL)
+    {
+        Timer *next = timer->next;
+        timer->slot = NULL;
+        insert(timer);
+        timer = next;
+    }
+}
+
+// reaps a connection whose deadline passed. shutting down the socket
+// wakes the thread blocked on it with an error. lock must be held, which
+// also keeps the fd from being closed meanwhile
+void TimerWheel::expire(Timer *timer)
+{
+    timer->expired = true;
+    reaped++;
+    shutdown(timer->fd, SHUT_RDWR);
+    log_warn("Request %llu reaped, %s deadline passed", timer->request_id, timer->phase);
+}
+
+// processes one tick: cascades higher levels when level 0 wraps, then
+// expires everything in the current level 0 slot. lock must be held
+void TimerWheel::tick()
+{
+    int index = current_tick & (WHEEL_SLOTS - 1);
+    for (int level = 1; index == 0 && level < WHEEL_LEVELS; level++)
+    {
+        index = (current_tick >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1);
+        cascade(level, index);
+    }
+
+    Timer **slot = &slots[0][current_tick & (WHEEL_SLOTS - 1)];
+    while (*slot != NULL)
+    {
+        Timer *timer = *slot;
+        unlink(timer);
+        expire(timer);
+    }
+    current_tick++;
+}
+
+// body of reaper thread, runs the ticks that have passed since last wakeup
+void TimerWheel::reap_loop()
+{
+    while (running.load())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(WHEEL_TICK_MS));
+        uint64_t target = (now_ms() - start_ms) / WHEEL_TICK_MS;
+
+        std::lock_guard<std::mutex> guard(lock);
+        while (current_tick <= target)
+            tick();
+    }
+}
+
+// starts the reaper thread
+void TimerWheel::start()
+{
+    if (running.exchange(true))
+        return;
+    reaper = std::thread(&TimerWheel::reap_loop, this);
+}
+
+// stops the reaper thread
+void TimerWheel::stop()
+{
+    if (!running.exchange(false))
+        return;
+    reaper.join();
+}
+
+// creates an unarmed timer for a connection's fd
+Timer *TimerWheel::add(int fd, unsigned long long request_id)
+{
+    Timer *timer = new Timer;
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->slot = NULL;
+    timer->expires = 0;
+    timer->fd = fd;
+    timer->phase = "";
+    timer->request_id = request_id;
+    timer->expired = false;
+    return timer;
+}
+
+/**************************************************
+ * sets or moves a timer's deadline
+ * Inputs:
+ *      - Timer *, timer to arm
+ *      - uint64_t, deadline in now_ms() time
+ *      - const char *, string literal naming phase, for log message
+ * Outputs:
+ *      - no return value
+**************************************************/
+void TimerWheel::arm_at(Timer *timer, uint64_t deadline_ms, const char *phase)
+{
+    uint64_t since_start = (deadline_ms > start_ms) ? deadline_ms - start_ms : 0;
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (timer->expired)
+        return;
+    unlink(timer);
+    timer->expires = (since_start + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    timer->phase = phase;
+    insert(timer);
+}
+
+// sets a timer's deadline to the given number of ms from now
+void TimerWheel::arm(Timer *timer, unsigned ms, const char *phase)
+{
+    arm_at(timer, now_ms() + ms, phase);
+}
+
+// cancels a timer's deadline
+void TimerWheel::disarm(Timer *timer)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    unlink(timer);
+}
+
+// cancels and frees a timer, must be done before its fd is closed
+void TimerWheel::remove(Timer *timer)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        unlink(timer);
+    }
+    delete timer;
+}
+
+// true if the timer's connection was reaped
+bool TimerWheel::expired(Timer *timer)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return timer->expired;
+}
+
+// number of connections reaped so far
+unsigned long long TimerWheel::get_reaped()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return reaped;
+}
@@ -0,0 +1,72 @@
+// Header file for TimerWheel class
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+// length of one tick of the wheel
+#define WHEEL_TICK_MS 50
+
+// each level has 64 slots, each slot of a level covers a whole turn of
+// the level below. with 4 levels deadlines up to ~9 days can be tracked
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+// deadlines for each phase of a connection
+#define DEADLINE_HANDSHAKE_MS 5000     // connect until first bytes of command
+#define DEADLINE_COMMAND_MS 10000      // rest of a message on command socket
+#define DEADLINE_CONNECT_MS 5000       // connecting back to client's data port
+#define DEADLINE_TRANSFER_GRACE_MS 10000
+#define MIN_TRANSFER_RATE 4096         // bytes per second after grace period
+
+// deadline of one connection. owned by its socket, which must remove it
+// from the wheel before closing the fd
+struct Timer
+{
+    Timer *prev;
+    Timer *next;
+    Timer **slot;           // head of list timer is in, NULL if not armed
+    uint64_t expires;       // tick when timer expires
+    int fd;
+    const char *phase;      // string literal naming what is being waited for
+    unsigned long long request_id;
+    bool expired;
+};
+
+class TimerWheel
+{
+    private:
+        std::mutex lock;
+        Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+        uint64_t current_tick;      // next tick to be processed
+        uint64_t start_ms;
+        std::thread reaper;
+        std::atomic<bool> running;
+        unsigned long long reaped;
+
+        void insert(Timer *timer);
+        void unlink(Timer *timer);
+        void cascade(int level, int index);
+        void expire(Timer *timer);
+        void tick();
+        void reap_loop();
+    public:
+        TimerWheel();
+        ~TimerWheel();
+        static uint64_t now_ms();
+        void start();
+        void stop();
+        Timer *add(int fd, unsigned long long request_id);
+        void arm_at(Timer *timer, uint64_t deadline_ms, const char *phase);
+        void arm(Timer *timer, unsigned ms, const char *phase);
+        void disarm(Timer *timer);
+        void remove(Timer *timer);
+        bool expired(Timer *timer);
+        unsigned long long get_reaped();
+};
+
+#endif
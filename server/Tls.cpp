@@ -0,0 +1,74 @@
+#include "Tls.hpp"
+#include "Logger.hpp"
+#include <openssl/err.h>
+
+// id resumed sessions must match, any constant works for a single server
+static const unsigned char session_context[] = "ftserver";
+
+// constructor, TLS disabled until init succeeds
+Tls::Tls()
+{
+    ctx = NULL;
+}
+
+// frees context, sessions using it must already be freed
+Tls::~Tls()
+{
+    if (ctx != NULL)
+        SSL_CTX_free(ctx);
+}
+
+/**************************************************
+ * creates the server's TLS context from a PEM file holding the server's
+ * certificate chain followed by its private key. TLS 1.2 is the minimum,
+ * with AES-GCM preferred so kernel TLS can take over encryption. resumption
+ * tickets let a client's data connection skip the full handshake
+ * Inputs:
+ *      - const char *, path of PEM file
+ * Outputs:
+ *      - bool, true if TLS can be used, false if not, error is logged
+**************************************************/
+bool Tls::init(const char *pem_path)
+{
+    SSL_CTX *new_ctx = SSL_CTX_new(TLS_server_method());
+    if (new_ctx == NULL)
+    {
+        log_error("unable to create TLS context");
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(new_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(new_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_ciphersuites(new_ctx, TLS_CIPHERSUITES);
+    SSL_CTX_set_cipher_list(new_ctx, TLS12_CIPHERS);
+    SSL_CTX_set_session_id_context(new_ctx, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(new_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_num_tickets(new_ctx, TLS_NUM_TICKETS);
+
+    if (SSL_CTX_use_certificate_chain_file(new_ctx, pem_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(new_ctx, pem_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(new_ctx) != 1)
+    {
+        char error[256];
+        ERR_error_string_n(ERR_get_error(), error, sizeof(error));
+        log_error("unable to load certificate and key from \"%s\": %s", pem_path, error);
+        SSL_CTX_free(new_ctx);
+        return false;
+    }
+
+    ctx = new_ctx;
+    log_info("TLS enabled with certificate \"%s\"", pem_path);
+    return true;
+}
+
+// true if init succeeded
+bool Tls::enabled()
+{
+    return ctx != NULL;
+}
+
+// getter for context, NULL if TLS is disabled
+SSL_CTX *Tls::get_ctx()
+{
+    return ctx;
+}
@@ -0,0 +1,31 @@
+// Header file for Tls class
+#ifndef TLS_HPP
+#define TLS_HPP
+
+#include <openssl/ssl.h>
+
+// ciphers the kernel can take over after the handshake (AES-GCM), and
+// ChaCha20 as a last resort for clients without AES support
+#define TLS_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define TLS12_CIPHERS "ECDHE+AESGCM:ECDHE+CHACHA20"
+
+// session tickets sent on each command connection, one resumes the
+// handshake of its data connection
+#define TLS_NUM_TICKETS 1
+
+// server side TLS settings shared by all connections. handshakes are done
+// by OpenSSL, which then hands the session keys to kernel TLS when the
+// kernel supports it, so sendfile and splice keep working
+class Tls
+{
+    private:
+        SSL_CTX *ctx;
+    public:
+        Tls();
+        ~Tls();
+        bool init(const char *pem_path);
+        bool enabled();
+        SSL_CTX *get_ctx();
+};
+
+#endif
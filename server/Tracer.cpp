@@ -0,0 +1,227 @@
+#include "Tracer.hpp"
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using std::string;
+using std::vector;
+
+std::atomic<uint64_t> Tracer::next_request(1);
+std::atomic<unsigned> Tracer::sample_every(TRACE_DEFAULT_SAMPLE);
+std::atomic<int> Tracer::num_rings(0);
+TraceRing *Tracer::rings[TRACE_MAX_THREADS];
+uint64_t Tracer::start_tsc = 0;
+uint64_t Tracer::start_ns = 0;
+
+// request the calling thread is working on, and whether it is traced
+static thread_local uint64_t current_request = 0;
+static thread_local bool current_sampled = false;
+
+static std::mutex register_lock;
+
+// rings of threads that have exited, given to the next threads to record
+// spans. guarded by register_lock
+static vector<TraceRing *> free_rings;
+
+// the calling thread's ring, handed back to free_rings when it exits.
+// spans the thread records after that are dropped
+struct RingHolder
+{
+    TraceRing *ring;
+    bool registered;
+
+    ~RingHolder()
+    {
+        if (ring == NULL)
+            return;
+        std::lock_guard<std::mutex> guard(register_lock);
+        free_rings.push_back(ring);
+        ring = NULL;
+    }
+};
+static thread_local RingHolder holder = { NULL, false };
+
+// nanoseconds from a monotonic clock
+static uint64_t steady_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// records the starting point used to convert timestamps to microseconds.
+// must be called once before any requests are handled
+void Tracer::init()
+{
+    start_ns = steady_ns();
+    start_tsc = now();
+}
+
+// reads the timestamp counter, or a monotonic clock if there isn't one
+uint64_t Tracer::now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return steady_ns();
+#endif
+}
+
+// starts a new request on the calling thread, returns its id
+uint64_t Tracer::new_request()
+{
+    uint64_t request_id = next_request.fetch_add(1, std::memory_order_relaxed);
+    set_request(request_id);
+    return request_id;
+}
+
+// sets the request the calling thread is working on. requests are traced
+// if their id is a multiple of the sample rate
+void Tracer::set_request(uint64_t request_id)
+{
+    unsigned every = sample_every.load(std::memory_order_relaxed);
+    current_request = request_id;
+    current_sampled = (every != 0 && request_id % every == 0);
+}
+
+// id of the request the calling thread is working on
+uint64_t Tracer::get_request()
+{
+    return current_request;
+}
+
+// true if the calling thread's current request is being traced
+bool Tracer::sampled()
+{
+    return current_sampled;
+}
+
+// sets how often requests are traced, 1 traces every request, 0 none
+void Tracer::set_sample_rate(unsigned every)
+{
+    sample_every.store(every, std::memory_order_relaxed);
+}
+
+// getter for sample rate
+unsigned Tracer::get_sample_rate()
+{
+    return sample_every.load(std::memory_order_relaxed);
+}
+
+// returns the calling thread's ring on first use, reusing the ring of a
+// thread that exited or else creating and registering one. returns NULL
+// if too many threads are recording spans
+TraceRing *Tracer::thread_ring()
+{
+    if (holder.registered)
+        return holder.ring;
+
+    std::lock_guard<std::mutex> guard(register_lock);
+    holder.registered = true;
+    if (!free_rings.empty())
+    {
+        // spans of the exited thread stay until overwritten
+        holder.ring = free_rings.back();
+        free_rings.pop_back();
+        holder.ring->thread_id.store(syscall(SYS_gettid), std::memory_order_relaxed);
+        return holder.ring;
+    }
+
+    int index = num_rings.load(std::memory_order_relaxed);
+    if (index == TRACE_MAX_THREADS)
+        return NULL;
+
+    TraceRing *ring = new TraceRing;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->thread_id.store(syscall(SYS_gettid), std::memory_order_relaxed);
+    rings[index] = ring;
+    num_rings.store(index + 1, std::memory_order_release);
+    holder.ring = ring;
+    return ring;
+}
+
+// adds a completed span for the current request to the calling thread's ring
+void Tracer::record(const char *name, uint64_t start, uint64_t end)
+{
+    TraceRing *ring = thread_ring();
+    if (ring == NULL)
+        return;
+
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceSpan &span = ring->spans[head % TRACE_RING_SPANS];
+    span.start_tsc = start;
+    span.end_tsc = end;
+    span.request_id = current_request;
+    span.name = name;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+/**************************************************
+ * builds a Chrome trace event JSON document (also read by Perfetto) with
+ * every span still held in the threads' rings, as complete ("X") events
+ * with the request id as an argument. rings are read while threads may
+ * still be writing, so spans that could have been overwritten during the
+ * copy are discarded. each ring's newest spans are added first, and spans
+ * that would make the document longer than max_len are left out
+ * Inputs:
+ *      - size_t, longest document returned
+ * Outputs:
+ *      - string, JSON document
+**************************************************/
+string Tracer::dump_json(size_t max_len)
+{
+    // ticks per microsecond, measured over the time since init
+    double ticks_per_us = (double)(now() - start_tsc) / ((steady_ns() - start_ns) / 1000.0);
+    if (ticks_per_us <= 0)
+        ticks_per_us = 1;
+
+    string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first_event = true;
+    vector<TraceSpan> copy;
+    int total_rings = num_rings.load(std::memory_order_acquire);
+
+    bool full = false;
+    for (int r = 0; r < total_rings && !full; r++)
+    {
+        TraceRing *ring = rings[r];
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = (head > TRACE_RING_SPANS) ? head - TRACE_RING_SPANS : 0;
+        copy.assign(ring->spans, ring->spans + TRACE_RING_SPANS);
+
+        // anything before this index may have been overwritten while copying,
+        // including the slot of index new_head, which may be mid write
+        uint64_t new_head = ring->head.load(std::memory_order_acquire);
+        if (new_head + 1 > TRACE_RING_SPANS && new_head + 1 - TRACE_RING_SPANS > first)
+            first = new_head + 1 - TRACE_RING_SPANS;
+
+        for (uint64_t i = head; i > first && !full; i--)
+        {
+            const TraceSpan &span = copy[(i - 1) % TRACE_RING_SPANS];
+            char event[256];
+            snprintf(event, sizeof(event),
+                     "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,"
+                     "\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"request\":%llu}}",
+                     first_event ? "" : ",", span.name,
+                     (double)(span.start_tsc - start_tsc) / ticks_per_us,
+                     (double)(span.end_tsc - span.start_tsc) / ticks_per_us,
+                     (int)getpid(), ring->thread_id.load(std::memory_order_relaxed),
+                     (unsigned long long)span.request_id);
+            // room is kept for the closing brackets
+            if (json.size() + strlen(event) + 2 > max_len)
+            {
+                full = true;
+                break;
+            }
+            json += event;
+            first_event = false;
+        }
+    }
+    json += "]}";
+    return json;
+}
@@ -0,0 +1,87 @@
+// Header file for Tracer class
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <atomic>
+
+using std::string;
+
+// number of spans kept for each thread, oldest are overwritten
+#define TRACE_RING_SPANS 4096
+
+// max number of threads that can record spans at once, rings of threads
+// that exited are reused
+#define TRACE_MAX_THREADS 1024
+
+// largest trace dump, spans past this are left out
+#define TRACE_DUMP_MAX (16 << 20)
+
+// by default one request in this many is traced
+#define TRACE_DEFAULT_SAMPLE 100
+
+// one completed phase of a request
+struct TraceSpan
+{
+    uint64_t start_tsc;
+    uint64_t end_tsc;
+    uint64_t request_id;
+    const char *name;       // string literal, only pointer is stored
+};
+
+// spans recorded by one thread, written only by that thread. rings are
+// never freed, so they can be read while threads exit
+struct TraceRing
+{
+    TraceSpan spans[TRACE_RING_SPANS];
+    std::atomic<uint64_t> head;     // number of spans ever written
+    std::atomic<uint32_t> thread_id;    // thread now writing, changes on reuse
+};
+
+class Tracer
+{
+    private:
+        static std::atomic<uint64_t> next_request;
+        static std::atomic<unsigned> sample_every;
+        static std::atomic<int> num_rings;
+        static TraceRing *rings[TRACE_MAX_THREADS];
+        static uint64_t start_tsc;
+        static uint64_t start_ns;
+
+        static TraceRing *thread_ring();
+    public:
+        static void init();
+        static uint64_t new_request();
+        static void set_request(uint64_t request_id);
+        static uint64_t get_request();
+        static bool sampled();
+        static uint64_t now();
+        static void record(const char *name, uint64_t start, uint64_t end);
+        static void set_sample_rate(unsigned every);
+        static unsigned get_sample_rate();
+        static string dump_json(size_t max_len);
+};
+
+// records the time from construction to destruction as a span of the
+// current request, if the request is being traced
+class ScopedSpan
+{
+    private:
+        const char *name;
+        uint64_t start;
+    public:
+        ScopedSpan(const char *span_name)
+        {
+            name = span_name;
+            start = Tracer::sampled() ? Tracer::now() : 0;
+        }
+        ~ScopedSpan()
+        {
+            if (start != 0)
+                Tracer::record(name, start, Tracer::now());
+        }
+};
+
+#endif
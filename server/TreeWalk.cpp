@@ -0,0 +1,107 @@
+#include "TreeWalk.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+using std::string;
+using std::vector;
+
+// constructor
+// accepts fd of open root directory, which stays owned by the caller, and
+// whether to descend into subdirectories
+TreeWalk::TreeWalk(int fd, bool r)
+{
+    root_fd = fd;
+    recursive = r;
+}
+
+/**************************************************
+ * reads one directory with batched getdents64 calls, visiting every
+ * non-hidden entry. names of subdirectories are collected for recursive
+ * walks. the names of each batch are copied out of the thread's buffer
+ * before the visitor is called, since visitors may use the buffer too
+ * Inputs:
+ *      - int, fd of open directory
+ *      - const string &, path of directory relative to root,
+ *        empty or ending in "/"
+ *      - const Visitor &, called for each entry
+ *      - vector<string> &, receives relative paths of subdirectories
+ * Outputs:
+ *      - bool, false if visitor stopped the walk or no buffer, true otherwise
+**************************************************/
+bool TreeWalk::scan_dir(int dir_fd, const string &prefix, const Visitor &visit,
+                        vector<string> &subdirs)
+{
+    vector<string> names;
+    while (true)
+    {
+        // node local buffer of this thread
+        char *buffer = Affinity::buffer();
+        if (buffer == NULL)
+            return false;
+        ssize_t nread = getdents64(dir_fd, buffer, WALK_DENTS_BUFFER);
+        if (nread <= 0)
+            break;
+
+        names.clear();
+        for (ssize_t pos = 0; pos < nread; )
+        {
+            struct dirent64 *entry = (struct dirent64 *)(buffer + pos);
+            pos += entry->d_reclen;
+
+            // skip hidden files, as well as . and ..
+            if (entry->d_name[0] != '.')
+                names.push_back(entry->d_name);
+        }
+
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            bool is_dir = false;
+            if (!visit(dir_fd, names[i].c_str(), prefix, is_dir))
+                return false;
+            if (recursive && is_dir)
+                subdirs.push_back(prefix + names[i] + "/");
+        }
+    }
+    return true;
+}
+
+/**************************************************
+ * visits every non-hidden entry of the tree, depth first in the order
+ * directories list them. directories that are removed or can't be read
+ * during the walk are skipped
+ * Inputs:
+ *      - const Visitor &, called for each entry
+ * Outputs:
+ *      - bool, true if whole tree visited, false if stopped
+**************************************************/
+bool TreeWalk::walk(const Visitor &visit)
+{
+    bool ok = true;
+    vector<string> pending;
+    pending.push_back("");
+    while (ok && !pending.empty())
+    {
+        string prefix = pending.back();
+        pending.pop_back();
+
+        int dir_fd = root_fd;
+        if (!prefix.empty())
+        {
+            dir_fd = openat(root_fd, prefix.c_str(),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (dir_fd < 0)
+                continue;   // removed or not readable, skip it
+        }
+
+        vector<string> subdirs;
+        ok = scan_dir(dir_fd, prefix, visit, subdirs);
+        if (dir_fd != root_fd)
+            close(dir_fd);
+
+        // push in reverse so subdirectories are visited in listing order
+        for (size_t i = subdirs.size(); i > 0; i--)
+            pending.push_back(subdirs[i - 1]);
+    }
+    return ok;
+}
@@ -0,0 +1,42 @@
+// Header file for TreeWalk class
+#ifndef TREEWALK_HPP
+#define TREEWALK_HPP
+
+#include <string>
+#include <vector>
+#include <functional>
+#include "Affinity.hpp"
+
+using std::string;
+using std::vector;
+
+// size of buffer passed to each getdents64 call, the thread's I/O buffer
+#define WALK_DENTS_BUFFER AFFINITY_BUFFER_SIZE
+
+/* visits the non-hidden entries of a directory tree, depth first, reading
+* each directory with batched getdents64 calls into the thread's node
+* local buffer. subdirectories are opened relative to the root directory's
+* fd without following symlinks. only the paths of directories waiting to
+* be visited are kept in memory
+*/
+class TreeWalk
+{
+    public:
+        /* called for each entry with the fd of its directory, its name, and
+        * the directory's path relative to the root (empty or ending in "/").
+        * sets is_dir to descend into the entry, returns false to stop
+        */
+        typedef std::function<bool(int dir_fd, const char *name, const string &prefix,
+                                   bool &is_dir)> Visitor;
+    private:
+        int root_fd;
+        bool recursive;
+
+        bool scan_dir(int dir_fd, const string &prefix, const Visitor &visit,
+                      vector<string> &subdirs);
+    public:
+        TreeWalk(int root_fd, bool recursive);
+        bool walk(const Visitor &visit);
+};
+
+#endif
@@ -0,0 +1,201 @@
+/******************************************************
+ * Program Name: ftpack
+ * Description:
+ *      builds a pack file from the non-hidden regular files of a
+ *      directory, for ftserver to serve with "-s <pack_file>". see
+ *      Pack.hpp for the format. the pack is written to a temp file next
+ *      to the destination and renamed into place when complete, so a
+ *      running server never sees a partial pack.
+ *      usage: ./ftpack <directory> <pack_file>
+ * ***************************************************/
+
+#include "Pack.hpp"
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+using std::string;
+using std::vector;
+
+// one file to be packed
+struct PackFile
+{
+    string name;
+    uint64_t len;
+    PackEntry entry;
+};
+
+// rounds offset up to next multiple of PACK_ALIGN
+static uint64_t align_up(uint64_t offset)
+{
+    return (offset + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+}
+
+// writes whole buffer at offset, returns false on error
+static bool write_at(int fd, const void *data, size_t len, uint64_t offset)
+{
+    const char *buffer = (const char *)data;
+    while (len > 0)
+    {
+        ssize_t written = pwrite(fd, buffer, len, offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        buffer += written;
+        len -= written;
+        offset += written;
+    }
+    return true;
+}
+
+// copies len bytes of a file into the pack at offset, in the kernel
+static bool copy_into(int pack_fd, int file_fd, uint64_t len, uint64_t offset)
+{
+    loff_t in_offset = 0;
+    loff_t out_offset = offset;
+    while (len > 0)
+    {
+        ssize_t copied = copy_file_range(file_fd, &in_offset, pack_fd, &out_offset, len, 0);
+        if (copied < 0 && errno == EINTR)
+            continue;
+        if (copied <= 0)
+            return false;
+        len -= copied;
+    }
+    return true;
+}
+
+// index order: by name hash, then name for files whose hashes collide
+static bool index_order(const PackFile *a, const PackFile *b)
+{
+    if (a->entry.hash != b->entry.hash)
+        return a->entry.hash < b->entry.hash;
+    return a->name < b->name;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: ./ftpack <directory> <pack_file>\n");
+        return 1;
+    }
+
+    // collect non-hidden regular files, same files ftserver would list
+    int dir_fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+    DIR *dir = (dir_fd < 0) ? NULL : fdopendir(dir_fd);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "ERROR: unable to open directory %s\n", argv[1]);
+        return 1;
+    }
+    vector<PackFile> files;
+    struct dirent *file = readdir(dir);
+    while (file != NULL)
+    {
+        struct stat stat_buffer;
+        if (file->d_name[0] != '.' && strchr(file->d_name, '\n') == NULL &&
+            fstatat(dir_fd, file->d_name, &stat_buffer, 0) == 0 && S_ISREG(stat_buffer.st_mode))
+        {
+            PackFile packed;
+            packed.name = file->d_name;
+            packed.len = stat_buffer.st_size;
+            files.push_back(packed);
+        }
+        file = readdir(dir);
+    }
+    std::sort(files.begin(), files.end(),
+              [](const PackFile &a, const PackFile &b) { return a.name < b.name; });
+
+    // lay out sections, names table is the newline separated listing
+    PackHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = PACK_VERSION;
+    header.entry_size = sizeof(PackEntry);
+    header.count = files.size();
+    header.index_offset = align_up(sizeof(PackHeader));
+    header.names_offset = header.index_offset + files.size() * sizeof(PackEntry);
+
+    string names;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (i != 0)
+            names += '\n';
+        PackEntry &entry = files[i].entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.hash = Pack::hash_name(files[i].name.c_str(), files[i].name.size());
+        entry.name_offset = names.size();
+        entry.name_len = files[i].name.size();
+        entry.len = files[i].len;
+        names += files[i].name;
+    }
+    header.names_len = names.size();
+    header.data_offset = align_up(header.names_offset + names.size());
+
+    uint64_t offset = header.data_offset;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        files[i].entry.offset = offset;
+        offset += files[i].len;
+    }
+    header.file_len = offset;
+
+    // write pack to temp file
+    string temp_name = string(argv[2]) + ".XXXXXX";
+    vector<char> temp_buffer(temp_name.begin(), temp_name.end());
+    temp_buffer.push_back('\0');
+    int pack_fd = mkstemp(temp_buffer.data());
+    if (pack_fd < 0)
+    {
+        fprintf(stderr, "ERROR: unable to create %s\n", temp_buffer.data());
+        return 1;
+    }
+    fchmod(pack_fd, 0644);
+
+    bool ok = ftruncate(pack_fd, header.file_len) == 0;
+    for (size_t i = 0; ok && i < files.size(); i++)
+    {
+        int file_fd = openat(dir_fd, files[i].name.c_str(), O_RDONLY);
+        ok = file_fd >= 0 && copy_into(pack_fd, file_fd, files[i].len, files[i].entry.offset);
+        if (!ok)
+            fprintf(stderr, "ERROR: unable to read %s\n", files[i].name.c_str());
+        if (file_fd >= 0)
+            close(file_fd);
+    }
+
+    vector<const PackFile *> sorted_index;
+    for (size_t i = 0; i < files.size(); i++)
+        sorted_index.push_back(&files[i]);
+    std::sort(sorted_index.begin(), sorted_index.end(), index_order);
+    vector<PackEntry> index_entries;
+    for (size_t i = 0; i < sorted_index.size(); i++)
+        index_entries.push_back(sorted_index[i]->entry);
+
+    ok = ok && write_at(pack_fd, &header, sizeof(header), 0);
+    ok = ok && write_at(pack_fd, index_entries.data(), index_entries.size() * sizeof(PackEntry),
+                        header.index_offset);
+    ok = ok && write_at(pack_fd, names.data(), names.size(), header.names_offset);
+    ok = ok && fsync(pack_fd) == 0;
+    ok = (close(pack_fd) == 0) && ok;
+    closedir(dir);
+
+    if (!ok || rename(temp_buffer.data(), argv[2]) < 0)
+    {
+        fprintf(stderr, "ERROR: unable to write pack %s\n", argv[2]);
+        unlink(temp_buffer.data());
+        return 1;
+    }
+
+    printf("Packed %llu files (%llu bytes) into %s\n", (unsigned long long)files.size(),
+           (unsigned long long)header.file_len, argv[2]);
+    return 0;
+}
@@ -19,6 +19,9 @@
  * ***************************************************/
 
 #include "Server.hpp"
+#include "Logger.hpp"
+#include "Tracer.hpp"
+#include "Affinity.hpp"
 #include <string>
 #include <cstdlib>
 #include <cstdio>
@@ -27,53 +30,130 @@
 #include <cctype>
 #include <cstring>
 #include <omp.h>
+#include <algorithm>
+#include <csignal>
 
 using std::cout;
 using std::endl;
 
+// minimum number of threads handling clients
+#define MIN_WORKERS 8
+
 bool valid_port(char*);
 
 int main(int argc, char* argv[])
 {
-    // check number of arguments
-    if (argc != 2)
+    // check arguments. port must be a number, options after it come in pairs:
+    //      -w <num_files>  load this many hot files into page cache at startup
+    //      -s <pack_file>  serve -l and -g from a pack built by ftpack
+    //      -t <pem_file>   use TLS, with certificate and key from pem_file
+    //      -u <unix_path>  also accept clients on a unix socket at unix_path
+    //      -a <cpu_list>   pin client threads to these CPUs, like 0-3,8
+    //      -q <0|1>        1 to handle each connection on the CPU that received it
+    bool valid_args = (argc >= 2 && argc % 2 == 0 && valid_port(argv[1]));
+    int warm_count = 0;
+    char *pack_path = NULL;
+    char *tls_path = NULL;
+    char *unix_path = NULL;
+    char *cpu_list = NULL;
+    bool steer = false;
+    for (int i = 2; valid_args && i < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-w") == 0 && valid_port(argv[i + 1]))
+            warm_count = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-s") == 0)
+            pack_path = argv[i + 1];
+        else if (strcmp(argv[i], "-t") == 0)
+            tls_path = argv[i + 1];
+        else if (strcmp(argv[i], "-u") == 0)
+            unix_path = argv[i + 1];
+        else if (strcmp(argv[i], "-a") == 0)
+            cpu_list = argv[i + 1];
+        else if (strcmp(argv[i], "-q") == 0 && valid_port(argv[i + 1]))
+            steer = (atoi(argv[i + 1]) != 0);
+        else
+            valid_args = false;
+    }
+    if (!valid_args)
     {
-        fprintf(stderr, "usage: ./ftserver <port#>\n");
+        fprintf(stderr, "usage: ./ftserver <port#> [-w <num_files>] [-s <pack_file>] [-t <pem_file>] [-u <unix_path>] [-a <cpu_list>] [-q <0|1>]\n");
         fflush(stderr);
         return 1;
     }
-    // make sure arg is a number
-    if (!valid_port(argv[1]))
+
+    // a client that disconnects mid transfer makes sendfile raise SIGPIPE,
+    // get the error return instead
+    signal(SIGPIPE, SIG_IGN);
+
+    // start background thread that writes log messages, and trace clock
+    Logger::start();
+    Tracer::init();
+    Affinity::init();
+    if (cpu_list != NULL && !Affinity::set_cpus(cpu_list))
     {
-        fprintf(stderr, "usage: ./ftserver <port#>\n");
-        fflush(stderr);
+        Logger::stop();
         return 1;
     }
+    Affinity::set_steering(steer);
 
     // create a Server, passing in port number
     Server server(argv[1]);
+
+    // open pack before listening, so no client sees the directory instead
+    if (pack_path != NULL && !server.open_pack(pack_path))
+    {
+        Logger::stop();
+        return 1;
+    }
+    if (tls_path != NULL && !server.enable_tls(tls_path))
+    {
+        Logger::stop();
+        return 1;
+    }
     
     // start server, returns true if successful, false if failed
-    if (server.start_server())
-        printf("Server now listening on port %s...\n", server.get_port());
+    if (server.start_server() && (unix_path == NULL || server.listen_unix(unix_path)))
+        log_info("Server now listening on port %s...", server.get_port());
     else
-        // server failed to start, exit with error code 1
+    {
+        // server failed to start, write out errors and exit with error code 1
+        Logger::stop();
         return 1;
+    }
+
+    // warm page cache with files that were most requested in earlier runs
+    if (warm_count > 0)
+        server.prewarm(warm_count);
 
-    // continuously loop to accept client connections
-    while (true)
+    // allow nested parallel regions, so work split across threads within
+    // a single request still runs in parallel while other clients are served
+    omp_set_max_active_levels(2);
+
+    // continuously loop to accept client connections. one thread accepts,
+    // the rest of the team handles clients as tasks. transfers mostly wait
+    // on sockets, so use at least MIN_WORKERS even with few cores.
+    // with -a, each thread is pinned to one of the given CPUs
+    int num_threads = std::max(omp_get_max_threads(), MIN_WORKERS) + 1;
+    server.set_workers(num_threads - 1);
+    #pragma omp parallel num_threads(num_threads)
     {
-        /************************************************/
-        // accept client connection
-        /************************************************/
+        Affinity::pin_thread(omp_get_thread_num());
+
+        #pragma omp single
+        while (true)
+        {
+            /************************************************/
+            // accept client connection
+            /************************************************/
 
-        // pass in address of pointer to store connected host name
-        Socketft *client = server.accept_client();
+            // pass in address of pointer to store connected host name
+            Socketft *client = server.accept_client();
 
-        // call member function to handle a client connection
-        #pragma omp task
-        server.handle_client(client);
-        
+            // call member function to handle a client connection
+            #pragma omp task firstprivate(client)
+            server.handle_client(client);
+            
+        }
     }
 
     return 0;
@@ -0,0 +1,91 @@
+// Helpers shared by the server's behavior tests, run with make test
+#ifndef TEST_HPP
+#define TEST_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+
+using std::string;
+using std::vector;
+
+static int test_failures = 0;
+
+// records a failed check with where it is, the test keeps going
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+// prints the outcome of a test program, returns its exit status
+static int test_result(const char *name)
+{
+    if (test_failures == 0)
+        printf("%s: passed\n", name);
+    else
+        printf("%s: %d checks failed\n", name, test_failures);
+    return test_failures == 0 ? 0 : 1;
+}
+
+// creates an empty directory under /tmp, returns its path
+static string make_temp_dir()
+{
+    char path[] = "/tmp/fttestXXXXXX";
+    if (mkdtemp(path) == NULL)
+    {
+        perror("mkdtemp");
+        exit(2);
+    }
+    return path;
+}
+
+// removes a directory made by make_temp_dir and everything in it
+static void remove_temp_dir(const string &path)
+{
+    string command = "rm -rf '" + path + "'";
+    if (system(command.c_str()) != 0)
+        fprintf(stderr, "unable to remove %s\n", path.c_str());
+}
+
+// writes contents to path, replacing any file there
+static bool write_file(const string &path, const string &contents)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, contents.data(), contents.size()) == (ssize_t)contents.size();
+    close(fd);
+    return ok;
+}
+
+// reads everything from fd until end of file
+static string read_all(int fd)
+{
+    string contents;
+    char buffer[65536];
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0)
+        contents.append(buffer, bytes_read);
+    return contents;
+}
+
+// bytes that don't repeat, so blocks and pieces are easy to tell apart
+static string random_bytes(size_t len, unsigned seed)
+{
+    string bytes(len, '\0');
+    for (size_t i = 0; i < len; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        bytes[i] = (char)(seed >> 16);
+    }
+    return bytes;
+}
+
+#endif
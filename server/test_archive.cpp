@@ -0,0 +1,249 @@
+// Tests for Archive and ArchivePool: every frame arrives in order with
+// the file's contents, however many threads compress, for trees larger
+// than the queue and archives sent at the same time
+#include "Archive.hpp"
+#include "test.hpp"
+#include <map>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// size of each frame's header, see Archive.hpp
+#define HEADER_LEN 32
+
+// an archive as the client rebuilds it
+struct Received
+{
+    std::map<string, string> files;
+    vector<string> dirs;
+    uint64_t total_files;
+    uint64_t total_bytes;
+    uint64_t deflated;          // frames that were compressed
+    uint64_t stored;
+    bool ended;
+};
+
+// reads a big endian integer of len bytes
+static uint64_t read_be(const char *buffer, int len)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < len; i++)
+        value = (value << 8) | (unsigned char)buffer[i];
+    return value;
+}
+
+/**************************************************
+ * reads frames until the end frame, checking each file's pieces come in
+ * order right after each other
+ * Inputs:
+ *      - int, fd to read from
+ *      - Received &, filled in with what was sent
+ * Outputs:
+ *      - bool, true if every frame was well formed and in order
+**************************************************/
+static bool receive(int fd, Received &received)
+{
+    Socketft socket((char *)"test", fd);
+    received.ended = false;
+    received.deflated = 0;
+    received.stored = 0;
+    string current;
+    while (!received.ended)
+    {
+        size_t len = 0;
+        char *frame = socket.recv_bytes(len, 1 << 24);
+        if (frame == nullptr)
+            return false;
+        uint8_t type = frame[0];
+        uint8_t encoding = frame[1];
+        size_t name_len = read_be(frame + 2, 2);
+        uint64_t offset = read_be(frame + 8, 8);
+        uint64_t size = read_be(frame + 16, 8);
+        bool ok = (len >= HEADER_LEN + name_len);
+        string path(frame + HEADER_LEN, ok ? name_len : 0);
+        const char *data = frame + HEADER_LEN + name_len;
+        size_t data_len = ok ? len - HEADER_LEN - name_len : 0;
+
+        if (ok && type == ARCHIVE_DIR)
+            received.dirs.push_back(path);
+        else if (ok && type == ARCHIVE_FILE)
+        {
+            // pieces of a file follow each other in order
+            string &contents = received.files[path];
+            ok = (offset == contents.size() && (offset == 0 || path == current));
+            current = path;
+
+            string piece(size, '\0');
+            uLongf piece_len = size;
+            if (encoding == ARCHIVE_DEFLATE)
+            {
+                ok = ok && uncompress((Bytef *)&piece[0], &piece_len, (const Bytef *)data,
+                                      data_len) == Z_OK && piece_len == size;
+                received.deflated++;
+            }
+            else
+            {
+                ok = ok && data_len == size;
+                piece.assign(data, data_len);
+                received.stored++;
+            }
+            contents += piece;
+        }
+        else if (ok && type == ARCHIVE_END)
+        {
+            received.total_files = offset;
+            received.total_bytes = size;
+            received.ended = true;
+        }
+        else
+            ok = false;
+        delete[] frame;
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+// sends an archive of dir with pool over a socket pair, and receives it
+static bool archive(const string &dir, ArchivePool &pool, Received &received)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return false;
+    bool sent = false;
+    uint64_t sent_files = 0;
+    std::thread sender([&]() {
+        Socketft socket((char *)"test", fds[0]);
+        Archive archive(&socket, &pool);
+        sent = archive.send_archive(dir.c_str());
+        sent_files = archive.get_total_files();
+        close(fds[0]);
+    });
+    bool ok = receive(fds[1], received);
+    sender.join();
+    close(fds[1]);
+    return ok && sent && sent_files == received.total_files;
+}
+
+// builds a tree with small, empty, multi piece and already compressed
+// files, returns the contents expected for each path
+static std::map<string, string> make_tree(const string &dir, int small_files)
+{
+    std::map<string, string> expected;
+    expected["text"] = string(3 * ARCHIVE_PIECE + 100, 'a');
+    expected["random"] = random_bytes(ARCHIVE_PIECE + 5, 1);
+    expected["empty"] = "";
+    expected["photo.jpg"] = random_bytes(2 * ARCHIVE_PIECE + 9, 2);
+    CHECK(mkdir((dir + "/sub").c_str(), 0755) == 0);
+    CHECK(mkdir((dir + "/sub/deeper").c_str(), 0755) == 0);
+    expected["sub/deeper/note"] = "note";
+    for (int i = 0; i < small_files; i++)
+        expected["sub/f" + std::to_string(i)] = "small file " + std::to_string(i);
+
+    for (std::map<string, string>::iterator it = expected.begin(); it != expected.end(); ++it)
+        CHECK(write_file(dir + "/" + it->first, it->second));
+    CHECK(write_file(dir + "/.hidden", "not sent"));
+    CHECK(symlink("text", (dir + "/link").c_str()) == 0);
+    return expected;
+}
+
+// true if received holds exactly the expected files and directories
+static bool matches(const Received &received, const std::map<string, string> &expected)
+{
+    uint64_t total_bytes = 0;
+    for (std::map<string, string>::const_iterator it = expected.begin(); it != expected.end(); ++it)
+        total_bytes += it->second.size();
+    return received.files == expected && received.total_files == expected.size() &&
+           received.total_bytes == total_bytes && received.dirs.size() == 2;
+}
+
+static void test_pool_sizes(const string &dir)
+{
+    std::map<string, string> expected = make_tree(dir, 10);
+
+    // with no threads the sender compresses every piece itself
+    int sizes[] = { 0, 1, 4 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        ArchivePool pool;
+        pool.start(sizes[i]);
+        Received received;
+        CHECK(archive(dir, pool, received));
+        CHECK(matches(received, expected));
+
+        // the 4 pieces of text shrink. every other file is one stored
+        // frame, but random bytes take 2 and the jpg 3
+        CHECK(received.deflated == 4);
+        CHECK(received.stored == expected.size() - 3 + 2 + 3);
+    }
+}
+
+static void test_large_tree(const string &dir)
+{
+    // more pieces than the queue holds, so the walk waits for sends
+    std::map<string, string> expected = make_tree(dir, ARCHIVE_QUEUE_PIECES * 2);
+    ArchivePool pool;
+    pool.start(4);
+
+    // archives sent at the same time share the pool
+    Received received[3];
+    bool ok[3];
+    vector<std::thread> clients;
+    for (int i = 0; i < 3; i++)
+        clients.push_back(std::thread([&, i]() { ok[i] = archive(dir, pool, received[i]); }));
+    for (int i = 0; i < 3; i++)
+    {
+        clients[i].join();
+        CHECK(ok[i] && matches(received[i], expected));
+    }
+}
+
+static void test_closed(const string &dir)
+{
+    std::map<string, string> expected = make_tree(dir, 0);
+    ArchivePool pool;
+    pool.start(2);
+
+    // client goes away after the first frame
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    bool sent = true;
+    std::thread sender([&]() {
+        Socketft socket((char *)"test", fds[0]);
+        Archive archive(&socket, &pool);
+        sent = archive.send_archive(dir.c_str());
+        close(fds[0]);
+    });
+    Socketft receiver((char *)"test", fds[1]);
+    size_t len;
+    delete[] receiver.recv_bytes(len, 1 << 24);
+    close(fds[1]);
+    sender.join();
+    CHECK(!sent);
+
+    // bytes held for the failed archive were given back
+    Received received;
+    CHECK(archive(dir, pool, received));
+    CHECK(matches(received, expected));
+
+    Received missing;
+    CHECK(!archive(dir + "/none", pool, missing));
+}
+
+int main()
+{
+    string dir = make_temp_dir();
+    string sizes = dir + "/sizes";
+    string large = dir + "/large";
+    string closed = dir + "/closed";
+    CHECK(mkdir(sizes.c_str(), 0755) == 0);
+    CHECK(mkdir(large.c_str(), 0755) == 0);
+    CHECK(mkdir(closed.c_str(), 0755) == 0);
+
+    test_pool_sizes(sizes);
+    test_large_tree(large);
+    test_closed(closed);
+    remove_temp_dir(dir);
+    return test_result("test_archive");
+}
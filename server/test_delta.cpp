@@ -0,0 +1,220 @@
+// Tests for Delta: signature parsing, the weak checksum, and that a delta
+// rebuilds the new file from the client's old copy
+#include "Delta.hpp"
+#include "test.hpp"
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+
+// appends a 32 bit value in network byte order
+static void append_u32(string &buffer, uint32_t value)
+{
+    value = htonl(value);
+    buffer.append((const char *)&value, 4);
+}
+
+// reads a 32 bit value in network byte order
+static uint32_t read_u32(const string &buffer, size_t pos)
+{
+    uint32_t value;
+    memcpy(&value, buffer.data() + pos, 4);
+    return ntohl(value);
+}
+
+// builds the signature a client sends for its copy, see Delta::parse_signature
+static string make_signature(const string &old_copy, uint32_t block_size)
+{
+    uint32_t block_count = old_copy.size() / block_size;
+    string signature;
+    append_u32(signature, block_size);
+    append_u32(signature, block_count);
+    for (uint32_t i = 0; i < block_count; i++)
+    {
+        const unsigned char *block = (const unsigned char *)old_copy.data() + (size_t)i * block_size;
+        unsigned char strong[EVP_MAX_MD_SIZE];
+        EVP_Digest(block, block_size, strong, NULL, EVP_md5(), NULL);
+        append_u32(signature, Delta::weak_checksum(block, block_size));
+        signature.append((const char *)strong, DELTA_STRONG_LEN);
+    }
+    return signature;
+}
+
+/**************************************************
+ * rebuilds a file from a delta stream the way the client does, writing
+ * over its old copy in place
+ * Inputs:
+ *      - const string &, delta stream, see Delta::send
+ *      - const string &, client's old copy
+ *      - uint32_t, block size of the signature
+ * Outputs:
+ *      - string, rebuilt file, empty if the stream is malformed
+**************************************************/
+static string apply_delta(const string &stream, const string &old_copy, uint32_t block_size)
+{
+    if (stream.size() < 9)
+        return "";
+    uint64_t file_len = ((uint64_t)read_u32(stream, 0) << 32) | read_u32(stream, 4);
+    string file = old_copy;
+    file.resize(std::max((uint64_t)file.size(), file_len));
+
+    uint64_t offset = 0;
+    size_t pos = 8;
+    while (pos < stream.size() && stream[pos] != 'E')
+    {
+        if (pos + 5 > stream.size())
+            return "";
+        char type = stream[pos];
+        uint32_t value = read_u32(stream, pos + 1);
+        pos += 5;
+        if (type == 'L')
+        {
+            if (pos + value > stream.size() || offset + value > file_len)
+                return "";
+            file.replace(offset, value, stream, pos, value);
+            pos += value;
+            offset += value;
+        }
+        else if (type == 'B')
+        {
+            // blocks before offset have been written over already
+            uint64_t block_offset = (uint64_t)value * block_size;
+            if (block_offset < offset || offset + block_size > file_len)
+                return "";
+            file.replace(offset, block_size, file, block_offset, block_size);
+            offset += block_size;
+        }
+        else
+            return "";
+    }
+    if (pos + 1 != stream.size() || offset != file_len)
+        return "";
+    file.resize(file_len);
+    return file;
+}
+
+// computes the delta of path against signature and returns what is sent
+static string delta_stream(const string &path, const string &signature, uint64_t &literal)
+{
+    Delta delta;
+    literal = 0;
+    if (!delta.parse_signature(signature.data(), signature.size()) ||
+        !delta.compute(path.c_str()))
+        return "";
+    literal = delta.literal_bytes();
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return "";
+    std::thread sender([&delta, &fds]() {
+        Socketft socket((char *)"test", fds[0]);
+        delta.send(&socket);
+        close(fds[0]);
+    });
+    string stream = read_all(fds[1]);
+    sender.join();
+    close(fds[1]);
+    return stream;
+}
+
+static void test_weak_checksum()
+{
+    // a is the byte sum, b the sum of the running values of a
+    const unsigned char abc[] = { 'a', 'b', 'c' };
+    CHECK(Delta::weak_checksum(abc, 3) == (294u | (586u << 16)));
+    CHECK(Delta::weak_checksum(abc, 0) == 0);
+
+    // sums are kept to 16 bits
+    string ones(70000, '\xff');
+    uint32_t weak = Delta::weak_checksum((const unsigned char *)ones.data(), ones.size());
+    CHECK((weak & 0xffff) == ((70000u * 255) & 0xffff));
+}
+
+static void test_parse_signature()
+{
+    string old_copy = random_bytes(4096 * 4, 1);
+    string signature = make_signature(old_copy, 4096);
+    Delta valid;
+    CHECK(valid.parse_signature(signature.data(), signature.size()));
+
+    Delta short_header;
+    CHECK(!short_header.parse_signature(signature.data(), 7));
+
+    Delta missing_block;
+    CHECK(!missing_block.parse_signature(signature.data(), signature.size() - 20));
+
+    Delta trailing;
+    string extra = signature + "x";
+    CHECK(!trailing.parse_signature(extra.data(), extra.size()));
+
+    Delta zero_block;
+    string zero;
+    append_u32(zero, 0);
+    append_u32(zero, 0);
+    CHECK(!zero_block.parse_signature(zero.data(), zero.size()));
+
+    // no blocks is a valid signature for a client with nothing
+    Delta empty;
+    string nothing;
+    append_u32(nothing, 4096);
+    append_u32(nothing, 0);
+    CHECK(empty.parse_signature(nothing.data(), nothing.size()));
+}
+
+static void test_rebuild(const string &dir)
+{
+    const uint32_t block_size = 4096;
+    string old_copy = random_bytes(3 << 20, 2);
+    string path = dir + "/new";
+    uint64_t literal;
+
+    // unchanged file is all block references
+    CHECK(write_file(path, old_copy));
+    string stream = delta_stream(path, make_signature(old_copy, block_size), literal);
+    CHECK(literal == 0);
+    CHECK(apply_delta(stream, old_copy, block_size) == old_copy);
+
+    // bytes changed and removed, spread over several segments
+    string new_copy = old_copy;
+    new_copy.replace(10000, 100, random_bytes(100, 3));
+    new_copy.erase(2500000, 777);
+    new_copy += "tail";
+    CHECK(write_file(path, new_copy));
+    stream = delta_stream(path, make_signature(old_copy, block_size), literal);
+    CHECK(literal > 0 && literal < 4 * block_size);
+    CHECK(apply_delta(stream, old_copy, block_size) == new_copy);
+
+    // bytes inserted. blocks after them are now past their old offset, and
+    // the client rebuilds in place, so the rest of the file is literal
+    new_copy = old_copy;
+    new_copy.insert(1500000, "inserted bytes");
+    CHECK(write_file(path, new_copy));
+    stream = delta_stream(path, make_signature(old_copy, block_size), literal);
+    CHECK(literal >= new_copy.size() - 1500000 && literal < new_copy.size() - 1490000);
+    CHECK(apply_delta(stream, old_copy, block_size) == new_copy);
+
+    // nothing in common, whole file is literal
+    string other = random_bytes(100000, 4);
+    CHECK(write_file(path, other));
+    stream = delta_stream(path, make_signature(old_copy, block_size), literal);
+    CHECK(literal == other.size());
+    CHECK(apply_delta(stream, old_copy, block_size) == other);
+
+    // file is now empty
+    CHECK(write_file(path, ""));
+    stream = delta_stream(path, make_signature(old_copy, block_size), literal);
+    CHECK(apply_delta(stream, old_copy, block_size) == "");
+    CHECK(stream.size() == 9);
+}
+
+int main()
+{
+    string dir = make_temp_dir();
+    test_weak_checksum();
+    test_parse_signature();
+    test_rebuild(dir);
+    remove_temp_dir(dir);
+    return test_result("test_delta");
+}
@@ -0,0 +1,190 @@
+// Tests for DirListing: the page and record format, paging, recursion,
+// and that listing_size matches what is sent
+#include "DirListing.hpp"
+#include "test.hpp"
+#include <map>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// size of each record in a page, see DirListing::send_page
+#define RECORD_LEN 40
+
+// one entry decoded from a listing
+struct Entry
+{
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mode;
+    uint64_t inode;
+};
+
+// reads a big endian integer of len bytes
+static uint64_t read_be(const char *buffer, int len)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < len; i++)
+        value = (value << 8) | (unsigned char)buffer[i];
+    return value;
+}
+
+/**************************************************
+ * lists a directory over a socket pair and decodes the pages
+ * Inputs:
+ *      - const string &, directory to list
+ *      - bool, whether listing is recursive
+ *      - map &, receives entries by path
+ *      - vector<uint32_t> &, receives the count of each page
+ *      - uint64_t &, receives total length of the pages, without framing
+ * Outputs:
+ *      - bool, true if every page was well formed and ended by an empty one
+**************************************************/
+static bool list(const string &dir, bool recursive, std::map<string, Entry> &entries,
+                 vector<uint32_t> &page_counts, uint64_t &listing_len)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return false;
+    bool sent = false;
+    uint64_t sent_entries = 0;
+    std::thread sender([&]() {
+        Socketft socket((char *)"test", fds[0]);
+        DirListing listing(&socket, recursive);
+        sent = listing.send_listing(dir.c_str());
+        sent_entries = listing.get_total_entries();
+        close(fds[0]);
+    });
+
+    Socketft receiver((char *)"test", fds[1]);
+    bool ok = true;
+    listing_len = 0;
+    while (ok)
+    {
+        size_t len = 0;
+        char *page = receiver.recv_bytes(len, 1 << 24);
+        if (page == nullptr)
+        {
+            ok = false;
+            break;
+        }
+        listing_len += len;
+
+        uint32_t count = read_be(page, 4);
+        uint32_t names_len = read_be(page + 4, 4);
+        const char *names = page + 8 + (size_t)count * RECORD_LEN;
+        ok = (len == 8 + (size_t)count * RECORD_LEN + names_len);
+        for (uint32_t i = 0; ok && i < count; i++)
+        {
+            const char *record = page + 8 + (size_t)i * RECORD_LEN;
+            uint32_t name_offset = read_be(record + 32, 4);
+            uint16_t name_len = read_be(record + 36, 2);
+            ok = ((uint64_t)name_offset + name_len <= names_len && read_be(record + 38, 2) == 0);
+            if (!ok)
+                break;
+
+            Entry entry;
+            entry.size = read_be(record, 8);
+            entry.mtime_sec = read_be(record + 8, 8);
+            entry.mode = read_be(record + 20, 4);
+            entry.inode = read_be(record + 24, 8);
+            entries[string(names + name_offset, name_len)] = entry;
+        }
+        delete[] page;
+        if (count == 0)
+            break;
+        page_counts.push_back(count);
+    }
+
+    sender.join();
+    close(fds[1]);
+    return ok && sent && sent_entries == entries.size();
+}
+
+// true if entry has the metadata lstat gives for path
+static bool matches(const Entry &entry, const string &path)
+{
+    struct stat stat_buffer;
+    if (lstat(path.c_str(), &stat_buffer) < 0)
+        return false;
+    return entry.mode == stat_buffer.st_mode && entry.inode == stat_buffer.st_ino &&
+           entry.mtime_sec == stat_buffer.st_mtime &&
+           (S_ISDIR(stat_buffer.st_mode) || entry.size == (uint64_t)stat_buffer.st_size);
+}
+
+static void test_small_tree(const string &dir)
+{
+    CHECK(write_file(dir + "/file", "ten bytes!"));
+    CHECK(write_file(dir + "/.hidden", "not listed"));
+    CHECK(mkdir((dir + "/sub").c_str(), 0755) == 0);
+    CHECK(write_file(dir + "/sub/inner", "x"));
+    CHECK(symlink("file", (dir + "/link").c_str()) == 0);
+
+    std::map<string, Entry> entries;
+    vector<uint32_t> pages;
+    uint64_t listing_len;
+    CHECK(list(dir, false, entries, pages, listing_len));
+    CHECK(entries.size() == 3);
+    CHECK(entries.count("file") && matches(entries["file"], dir + "/file"));
+    CHECK(entries.count("sub") && matches(entries["sub"], dir + "/sub"));
+    CHECK(entries.count("link") && S_ISLNK(entries["link"].mode));
+    CHECK(entries["file"].size == 10);
+    CHECK(listing_len == DirListing::listing_size(dir.c_str()));
+
+    // recursive listings give paths relative to the listed directory
+    entries.clear();
+    pages.clear();
+    CHECK(list(dir, true, entries, pages, listing_len));
+    CHECK(entries.size() == 4);
+    CHECK(entries.count("sub/inner") && matches(entries["sub/inner"], dir + "/sub/inner"));
+}
+
+static void test_pages(const string &dir)
+{
+    const int files = LISTING_PAGE_ENTRIES + 500;
+    string many = dir + "/many";
+    CHECK(mkdir(many.c_str(), 0755) == 0);
+    for (int i = 0; i < files; i++)
+        CHECK(write_file(many + "/f" + std::to_string(i), ""));
+
+    std::map<string, Entry> entries;
+    vector<uint32_t> pages;
+    uint64_t listing_len;
+    CHECK(list(many, false, entries, pages, listing_len));
+    CHECK(entries.size() == (size_t)files);
+    CHECK(pages.size() == 2 && pages[0] == LISTING_PAGE_ENTRIES && pages[1] == 500);
+    CHECK(listing_len == DirListing::listing_size(many.c_str()));
+
+    // a full last page is followed straight by the empty page
+    for (int i = LISTING_PAGE_ENTRIES; i < files; i++)
+        CHECK(unlink((many + "/f" + std::to_string(i)).c_str()) == 0);
+    entries.clear();
+    pages.clear();
+    CHECK(list(many, false, entries, pages, listing_len));
+    CHECK(pages.size() == 1 && pages[0] == LISTING_PAGE_ENTRIES);
+    CHECK(listing_len == DirListing::listing_size(many.c_str()));
+
+    CHECK(DirListing::listing_size((dir + "/missing").c_str()) == 0);
+}
+
+static void test_empty(const string &dir)
+{
+    string empty = dir + "/empty";
+    CHECK(mkdir(empty.c_str(), 0755) == 0);
+
+    std::map<string, Entry> entries;
+    vector<uint32_t> pages;
+    uint64_t listing_len;
+    CHECK(list(empty, true, entries, pages, listing_len));
+    CHECK(entries.empty() && pages.empty());
+    CHECK(listing_len == 8 && listing_len == DirListing::listing_size(empty.c_str()));
+}
+
+int main()
+{
+    string dir = make_temp_dir();
+    test_small_tree(dir);
+    test_pages(dir);
+    test_empty(dir);
+    remove_temp_dir(dir);
+    return test_result("test_listing");
+}
@@ -0,0 +1,169 @@
+// Tests for Pack: looking up files in a pack built by ftpack, names that
+// share a hash, and packs that must be refused
+#include "Pack.hpp"
+#include "test.hpp"
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <sys/stat.h>
+
+// contents of file i of the test directory
+static string file_contents(int i)
+{
+    return random_bytes(i * 37, i);
+}
+
+// builds a pack of dir with ftpack, returns its path
+static string build_pack(const string &dir)
+{
+    string pack_path = dir + ".pack";
+    string command = "./ftpack '" + dir + "' '" + pack_path + "' > /dev/null";
+    CHECK(system(command.c_str()) == 0);
+    return pack_path;
+}
+
+// reads a packed file's contents through the pack's fd
+static string packed_contents(Pack &pack, const PackEntry *entry)
+{
+    string contents(entry->len, '\0');
+    if (entry->len > 0 &&
+        pread(pack.get_fd(), &contents[0], entry->len, entry->offset) != (ssize_t)entry->len)
+        return "";
+    return contents;
+}
+
+// copies a pack and writes len bytes of data over it at offset
+static string corrupt_copy(const string &pack_path, uint64_t offset, const void *data, size_t len)
+{
+    int fd = open(pack_path.c_str(), O_RDONLY);
+    string contents = read_all(fd);
+    close(fd);
+    if (offset + len > contents.size())
+        contents.resize(offset + len);
+    memcpy(&contents[offset], data, len);
+
+    string copy_path = pack_path + ".bad";
+    CHECK(write_file(copy_path, contents));
+    return copy_path;
+}
+
+static void test_lookup(const string &dir)
+{
+    const int files = 200;
+    for (int i = 0; i < files; i++)
+    {
+        string name = "file" + std::to_string(i);
+        CHECK(write_file(dir + "/" + name, file_contents(i)));
+    }
+    CHECK(write_file(dir + "/.hidden", "not packed"));
+    CHECK(mkdir((dir + "/sub").c_str(), 0755) == 0);
+
+    Pack pack;
+    CHECK(pack.open_pack(build_pack(dir).c_str()));
+    CHECK(pack.is_open() && pack.count() == (uint64_t)files);
+
+    for (int i = 0; i < files; i++)
+    {
+        string name = "file" + std::to_string(i);
+        const PackEntry *entry = pack.find(name.c_str());
+        CHECK(entry != NULL && packed_contents(pack, entry) == file_contents(i));
+    }
+    CHECK(pack.find("file200") == NULL);
+    CHECK(pack.find("file") == NULL);
+    CHECK(pack.find("") == NULL);
+    CHECK(pack.find(".hidden") == NULL);
+    CHECK(pack.find("sub") == NULL);
+
+    // listing is the sorted names, one per line
+    size_t len;
+    const char *names = pack.listing(len);
+    string expected;
+    vector<string> sorted;
+    for (int i = 0; i < files; i++)
+        sorted.push_back("file" + std::to_string(i));
+    std::sort(sorted.begin(), sorted.end());
+    for (size_t i = 0; i < sorted.size(); i++)
+        expected += (i == 0 ? "" : "\n") + sorted[i];
+    CHECK(string(names, len) == expected);
+}
+
+static void test_shared_hash(const string &dir)
+{
+    CHECK(write_file(dir + "/a", "first"));
+    CHECK(write_file(dir + "/b", "second"));
+    CHECK(write_file(dir + "/c", "third"));
+    string pack_path = build_pack(dir);
+
+    // give the first index entry the hash of the second, as if their
+    // names collided. the index stays sorted
+    PackHeader header;
+    PackEntry index[3];
+    int fd = open(pack_path.c_str(), O_RDONLY);
+    CHECK(pread(fd, &header, sizeof(header), 0) == sizeof(header));
+    CHECK(pread(fd, index, sizeof(index), header.index_offset) == sizeof(index));
+    close(fd);
+    string collided = corrupt_copy(pack_path, header.index_offset, &index[1].hash, 8);
+
+    string second_name = index[1].name_offset == 0 ? "a" : (index[1].name_offset == 2 ? "b" : "c");
+    Pack pack;
+    CHECK(pack.open_pack(collided.c_str()));
+    const PackEntry *entry = pack.find(second_name.c_str());
+    CHECK(entry != NULL && entry->name_offset == index[1].name_offset);
+}
+
+static void test_invalid(const string &dir)
+{
+    CHECK(write_file(dir + "/only", "contents"));
+    string pack_path = build_pack(dir);
+
+    Pack missing;
+    CHECK(!missing.open_pack((dir + "/none").c_str()));
+    CHECK(!missing.is_open());
+
+    Pack bad_magic;
+    CHECK(!bad_magic.open_pack(corrupt_copy(pack_path, 0, "NOTAPACK", 8).c_str()));
+
+    Pack too_short;
+    CHECK(write_file(pack_path + ".short", "FTPACK01"));
+    CHECK(!too_short.open_pack((pack_path + ".short").c_str()));
+
+    // file_len must be the size of the pack
+    uint64_t wrong_len = 1;
+    Pack bad_len;
+    CHECK(!bad_len.open_pack(corrupt_copy(pack_path, offsetof(PackHeader, file_len),
+                                          &wrong_len, 8).c_str()));
+
+    // index can't run past the end of the pack
+    uint64_t huge_count = 1ULL << 40;
+    Pack bad_count;
+    CHECK(!bad_count.open_pack(corrupt_copy(pack_path, offsetof(PackHeader, count),
+                                            &huge_count, 8).c_str()));
+
+    // an entry pointing past the end of the pack isn't returned
+    PackHeader header;
+    int fd = open(pack_path.c_str(), O_RDONLY);
+    CHECK(pread(fd, &header, sizeof(header), 0) == sizeof(header));
+    close(fd);
+    uint64_t bad_offset = header.file_len + 1;
+    Pack bad_entry;
+    CHECK(bad_entry.open_pack(corrupt_copy(pack_path, header.index_offset + offsetof(PackEntry, offset),
+                                           &bad_offset, 8).c_str()));
+    CHECK(bad_entry.find("only") == NULL);
+}
+
+int main()
+{
+    string dir = make_temp_dir();
+    string lookup = dir + "/lookup";
+    string shared = dir + "/shared";
+    string invalid = dir + "/invalid";
+    CHECK(mkdir(lookup.c_str(), 0755) == 0);
+    CHECK(mkdir(shared.c_str(), 0755) == 0);
+    CHECK(mkdir(invalid.c_str(), 0755) == 0);
+
+    test_lookup(lookup);
+    test_shared_hash(shared);
+    test_invalid(invalid);
+    remove_temp_dir(dir);
+    return test_result("test_pack");
+}
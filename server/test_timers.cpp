@@ -0,0 +1,114 @@
+// Tests for TimerWheel: deadlines expire on time, including those that
+// start in a higher level and cascade down, and disarmed or removed
+// timers don't. the wheel runs in real time, so this takes a few seconds
+#include "TimerWheel.hpp"
+#include "test.hpp"
+#include <chrono>
+#include <sys/socket.h>
+
+// longest a deadline may be late, a tick plus the reaper's sleep
+#define LATE_MS (3 * WHEEL_TICK_MS)
+
+// a connection for a timer to reap
+struct TestConnection
+{
+    int fds[2];
+    Timer *timer;
+};
+
+static void open_connection(TimerWheel &wheel, TestConnection &connection, int id)
+{
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, connection.fds) == 0);
+    connection.timer = wheel.add(connection.fds[0], id);
+}
+
+static void close_connection(TimerWheel &wheel, TestConnection &connection)
+{
+    wheel.remove(connection.timer);
+    close(connection.fds[0]);
+    close(connection.fds[1]);
+}
+
+// sleeps until ms after start
+static void sleep_until(uint64_t start, uint64_t ms)
+{
+    uint64_t now = TimerWheel::now_ms();
+    if (now < start + ms)
+        std::this_thread::sleep_for(std::chrono::milliseconds(start + ms - now));
+}
+
+int main()
+{
+    TimerWheel wheel;
+    wheel.start();
+    uint64_t start = TimerWheel::now_ms();
+
+    // due within the first turn of level 0
+    TestConnection soon;
+    open_connection(wheel, soon, 1);
+    wheel.arm_at(soon.timer, start + 500, "soon");
+
+    // more than one turn of level 0 away, cascaded down when it wraps
+    uint64_t later_ms = (WHEEL_SLOTS + 16) * WHEEL_TICK_MS;
+    TestConnection later;
+    open_connection(wheel, later, 2);
+    wheel.arm_at(later.timer, start + later_ms, "later");
+
+    // disarmed before it is due
+    TestConnection disarmed;
+    open_connection(wheel, disarmed, 3);
+    wheel.arm_at(disarmed.timer, start + 500, "disarmed");
+    wheel.disarm(disarmed.timer);
+
+    // moved from soon to later than the whole test
+    TestConnection moved;
+    open_connection(wheel, moved, 4);
+    wheel.arm_at(moved.timer, start + 500, "moved");
+    wheel.arm(moved.timer, 60 * 1000, "moved");
+
+    // past the top level, clamped rather than wrapped around
+    TestConnection far;
+    open_connection(wheel, far, 5);
+    wheel.arm(far.timer, 30u * 24 * 3600 * 1000, "far");
+
+    // already due
+    TestConnection past;
+    open_connection(wheel, past, 6);
+    wheel.arm_at(past.timer, start - 1000, "past");
+
+    sleep_until(start, 500 - LATE_MS);
+    CHECK(!wheel.expired(soon.timer));
+    CHECK(wheel.expired(past.timer));
+
+    sleep_until(start, 500 + LATE_MS);
+    CHECK(wheel.expired(soon.timer));
+    CHECK(!wheel.expired(disarmed.timer));
+    CHECK(!wheel.expired(moved.timer));
+
+    // reaping shuts the socket down, the peer sees end of file
+    char byte;
+    CHECK(read(soon.fds[1], &byte, 1) == 0);
+
+    sleep_until(start, later_ms - LATE_MS);
+    CHECK(!wheel.expired(later.timer));
+    sleep_until(start, later_ms + LATE_MS);
+    CHECK(wheel.expired(later.timer));
+
+    CHECK(!wheel.expired(disarmed.timer));
+    CHECK(!wheel.expired(moved.timer));
+    CHECK(!wheel.expired(far.timer));
+    CHECK(wheel.get_reaped() == 3);
+
+    // an expired timer stays expired, arming it again does nothing
+    wheel.arm(soon.timer, 0, "again");
+    CHECK(wheel.expired(soon.timer));
+
+    wheel.stop();
+    close_connection(wheel, soon);
+    close_connection(wheel, later);
+    close_connection(wheel, disarmed);
+    close_connection(wheel, moved);
+    close_connection(wheel, far);
+    close_connection(wheel, past);
+    return test_result("test_timers");
+}